@@ -0,0 +1,60 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "adapt.h"
+#include "payload.h"
+
+#include <string.h>
+#include <sdkconfig.h>
+
+// Fraction lost is in 1/256: step down above ~5%, only step up below ~1%
+#define LOSS_BAD 13
+#define LOSS_GOOD 3
+#define JITTER_BAD_US (2 * CONFIG_AUDIO_RTP_PTIME_MS * 1000)
+#define JITTER_GOOD_US (CONFIG_AUDIO_RTP_PTIME_MS * 1000 / 2)
+
+// Step down quickly, step up slowly so that a flapping link settles on the lower level
+#define BAD_REPORTS 2
+#define GOOD_REPORTS 5
+
+void adapt_init(adapt_t *adapt)
+{
+    memset(adapt, 0, sizeof(*adapt));
+}
+
+// Returns true when the level changed
+bool adapt_update(adapt_t *adapt, uint8_t fraction_lost, uint32_t jitter_us)
+{
+    if (fraction_lost > LOSS_BAD || jitter_us > JITTER_BAD_US)
+    {
+        adapt->good = 0;
+        if (++adapt->bad < BAD_REPORTS || adapt->level == PAYLOAD_FORMAT_COUNT - 1)
+            return false;
+
+        adapt->level++;
+    }
+    else if (fraction_lost <= LOSS_GOOD && jitter_us <= JITTER_GOOD_US)
+    {
+        adapt->bad = 0;
+        if (++adapt->good < GOOD_REPORTS || adapt->level == 0)
+            return false;
+
+        adapt->level--;
+    }
+    else
+    {
+        // In between: keep the current level
+        adapt->bad = 0;
+        adapt->good = 0;
+        return false;
+    }
+
+    adapt->bad = 0;
+    adapt->good = 0;
+    adapt->switches++;
+
+    return true;
+}
@@ -0,0 +1,25 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/*
+ * Chooses the payload format level (see payload.h) from the loss and jitter
+ * reported by the receiver. Level 0 is the best quality.
+ */
+typedef struct adapt
+{
+    uint8_t level;
+    uint8_t bad;  // Consecutive degraded reports
+    uint8_t good; // Consecutive clean reports
+    uint32_t switches;
+} adapt_t;
+
+void adapt_init(adapt_t *adapt);
+bool adapt_update(adapt_t *adapt, uint8_t fraction_lost, uint32_t jitter_us);
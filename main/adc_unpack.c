@@ -0,0 +1,106 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "adc_unpack.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * With a power of 2 channel count, a result is valid when the channel bits
+ * above it are clear, which checks the 2 results of a 32 bit word at once
+ * (0x80008000 for 8 channels). With another count, only channel 0 takes the
+ * word path and the other results are checked one at a time.
+ */
+_Static_assert(ADC_UNPACK_CHANNELS > 0 && ADC_UNPACK_CHANNELS <= 16, "The channel is a 4 bit field");
+#define INVALID_BITS ((ADC_UNPACK_CHANNELS & (ADC_UNPACK_CHANNELS - 1)) == 0 ? 0xf & ~(ADC_UNPACK_CHANNELS - 1) : 0xf)
+#define INVALID_MASK (((uint32_t)INVALID_BITS << 12) | ((uint32_t)INVALID_BITS << 28))
+
+static inline uint16_t unpack_one(uint16_t result, uint16_t last)
+{
+    if ((result >> 12) >= ADC_UNPACK_CHANNELS)
+        return last;
+
+    return result & 0x0fff;
+}
+
+static inline void store(void *out, size_t i, uint16_t data, bool wide)
+{
+    if (wide)
+        ((uint16_t *)out)[i] = data << 4;
+    else
+        ((uint8_t *)out)[i] = data >> 4;
+}
+
+/*
+ * Results are read 2 per 32 bit load, which needs an aligned word: the first
+ * result is converted on its own when the buffer is only 2 byte aligned, like
+ * in the middle of a DMA frame. Inlined for each output width.
+ */
+static inline __attribute__((always_inline)) void unpack(const uint8_t *results, size_t count, void *out, uint16_t *last, bool wide)
+{
+    uint16_t data = *last;
+    size_t i = 0;
+
+    if (((uintptr_t)results & 2) && count > 0)
+    {
+        data = unpack_one(*(const uint16_t *)results, data);
+        store(out, i++, data, wide);
+    }
+
+    const uint8_t *words = __builtin_assume_aligned(results + i * ADC_UNPACK_RESULT_BYTES, 4);
+
+    for (; i + 2 <= count; i += 2, words += 4)
+    {
+        uint32_t w;
+
+        memcpy(&w, words, sizeof(w));
+        if ((w & INVALID_MASK) == 0)
+        {
+            store(out, i, w & 0x0fff, wide);
+            data = (w >> 16) & 0x0fff;
+        }
+        else
+        {
+            data = unpack_one(w, data);
+            store(out, i, data, wide);
+            data = unpack_one(w >> 16, data);
+        }
+        store(out, i + 1, data, wide);
+    }
+
+    if (i < count)
+    {
+        data = unpack_one(*(const uint16_t *)words, data);
+        store(out, i, data, wide);
+    }
+
+    *last = data;
+}
+
+void adc_unpack_8(const uint8_t *restrict results, size_t count, uint8_t *restrict out, uint16_t *last)
+{
+    unpack(results, count, out, last, false);
+}
+
+void adc_unpack_16(const uint8_t *restrict results, size_t count, uint16_t *restrict out, uint16_t *last)
+{
+    unpack(results, count, out, last, true);
+}
+
+void adc_unpack_8_reference(const uint8_t *results, size_t count, uint8_t *out, uint16_t *last)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        uint16_t result = results[2 * i] | (results[2 * i + 1] << 8);
+        uint16_t channel = result >> 12;
+
+        if (channel < ADC_UNPACK_CHANNELS)
+            *last = result & 0x0fff;
+
+        out[i] = *last >> 4;
+    }
+}
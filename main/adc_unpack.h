@@ -0,0 +1,33 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Conversion of the ADC DMA results (ADC_DIGI_OUTPUT_FORMAT_TYPE1: 16 bits
+ * little endian, 12 data bits then the 4 bit channel) into samples.
+ *
+ * A result with a channel that does not exist on ADC1 is invalid and repeats
+ * the previous sample, kept in last across calls. The kernels only depend on
+ * the DMA format, so that they can be checked on a host against the scalar
+ * reference.
+ */
+#define ADC_UNPACK_RESULT_BYTES 2
+// Channels of ADC1 (unit 0) on this chip, can be given on a host
+#ifndef ADC_UNPACK_CHANNELS
+#include <soc/soc_caps.h>
+#define ADC_UNPACK_CHANNELS SOC_ADC_CHANNEL_NUM(0)
+#endif
+
+// 8 bit unsigned samples (L8), the 8 MSB of the 12 data bits
+void adc_unpack_8(const uint8_t *results, size_t count, uint8_t *out, uint16_t *last);
+// 16 bit unsigned samples, the 12 data bits left aligned
+void adc_unpack_16(const uint8_t *results, size_t count, uint16_t *out, uint16_t *last);
+// One result at a time, as the DMA format is documented
+void adc_unpack_8_reference(const uint8_t *results, size_t count, uint8_t *out, uint16_t *last);
@@ -8,64 +8,509 @@
 #include <string.h>
 #include <sdkconfig.h>
 #include <esp_check.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/queue.h>
 #include <driver/dac_continuous.h>
+#include <soc/soc_caps.h>
 #include <errno.h>
+#include <sys/param.h>
 
 #include "audio_player.h"
+#include "memstats.h"
 #include "udp.h"
+#include "mixer.h"
+#include "outbuf.h"
+#include "payload.h"
 #include "rtp.h"
+#if CONFIG_AUDIO_SYNC
+#include "sync.h"
+#endif
+
+#define DAC_DESC_NUM 4
+#define DAC_BUF_SIZE 2048
+#if SOC_DAC_DMA_16BIT_ALIGN
+// Each sample takes 16 bits in the DMA buffers
+#define DAC_BYTES_PER_SAMPLE 2
+#else
+#define DAC_BYTES_PER_SAMPLE 1
+#endif
+#define DAC_BUF_SAMPLES (DAC_BUF_SIZE / DAC_BYTES_PER_SAMPLE)
+// A loaded DMA buffer is played after the other ones
+#define DAC_PLAY_DELAY_US (((uint64_t)(DAC_DESC_NUM - 1) * DAC_BUF_SAMPLES * 1000000) / CONFIG_AUDIO_SAMPLE_RATE)
+
+// Audio buffered before playing: a DMA buffer to load, plus the configured margin
+#define PREFILL_SAMPLES (DAC_BUF_SAMPLES + (CONFIG_AUDIO_SAMPLE_RATE * CONFIG_AUDIO_PLAYER_PREFILL_MS) / 1000)
+#if CONFIG_AUDIO_SYNC
+#define SYNC_TOLERANCE ((CONFIG_AUDIO_SAMPLE_RATE * CONFIG_AUDIO_SYNC_TOLERANCE_MS) / 1000)
+#endif
+
+// Stack depths are in bytes. The task upsamples reduced rate payloads, mixes frames and prepares DMA buffers on its stack.
+#define UPSAMPLE_LEN 512
+#if RTP_MAX_SOURCES > 1
+#define MIX_FRAME 256
+#define MIX_STACK (3 * MIX_FRAME)
+#else
+#define MIX_STACK 0
+#endif
+#if CONFIG_AUDIO_SINGLE_TASK
+// The task also runs the RTP receive path
+#define RECV_STACK 1024
+#else
+#define RECV_STACK 0
+#endif
+#if CONFIG_AUDIO_PLAYER_DRIFT_PPM > 0
+#define DRIFT_CHUNK 256
+#define DRIFT_STACK DRIFT_OUT_LEN(DRIFT_CHUNK)
+#else
+#define DRIFT_STACK 0
+#endif
+#define PLAYER_TASK_STACK (4096 + UPSAMPLE_LEN + MIX_STACK + DRIFT_STACK + DAC_BUF_SAMPLES + RECV_STACK)
 
 static const char *TAG = "audio_player";
 static int irq_counter = 0;
 
+/*
+ * Called when the DAC is done with a DMA buffer, which must be loaded again
+ * before the DMA gets back to it.
+ */
 static bool IRAM_ATTR dac_on_convert_done_callback(dac_continuous_handle_t handle, const dac_event_data_t *event, void *user_data)
 {
-    QueueHandle_t que = (QueueHandle_t)user_data;
-    BaseType_t need_awoke;
+    audio_player_t *player = user_data;
+    BaseType_t need_awoke = pdFALSE;
     irq_counter += 1;
 
-    /* When the queue is full, drop the oldest item */
-    if (xQueueIsQueueFullFromISR(que))
+    sched_wake(&player->latency);
+
+    /* When the queue is full, the player is late: the oldest buffer will be played again as is */
+    if (xQueueIsQueueFullFromISR(player->que))
     {
         dac_event_data_t dummy;
-        xQueueReceiveFromISR(que, &dummy, &need_awoke);
+        xQueueReceiveFromISR(player->que, &dummy, &need_awoke);
+        player->late_refills++;
     }
     /* Send the event from callback */
-    xQueueSendFromISR(que, event, &need_awoke);
+    xQueueSendFromISR(player->que, event, &need_awoke);
     return need_awoke;
 }
 
-static void dac_write_data_asynchronously(dac_continuous_handle_t handle, QueueHandle_t que, uint8_t *data, size_t data_size)
+/*
+ * Play the next samples of the clip over the len samples of the stream. The
+ * stream keeps being read while a clip replaces it, so that it goes on in
+ * time afterwards. A whole DMA buffer of clip is loaded straight from flash.
+ */
+static const uint8_t *play_clip(audio_player_t *player, uint8_t *samples, size_t len)
+{
+    player_clip_t *clip = &player->clip;
+    size_t n = MIN(len, clip->remaining);
+    const uint8_t *played = samples;
+
+    if (clip->mix)
+        mixer_overlay(samples, clip->samples, n);
+    else if (n == len)
+        played = clip->samples;
+    else
+        memcpy(samples, clip->samples, n);
+
+    clip->samples += n;
+    clip->remaining -= n;
+
+    return played;
+}
+
+// Load a DMA buffer with the next samples, completed with silence when the audio ran out
+static void refill(audio_player_t *player, const dac_event_data_t *evt)
+{
+    uint8_t samples[DAC_BUF_SAMPLES];
+    size_t len = MIN(evt->buf_size / DAC_BYTES_PER_SAMPLE, DAC_BUF_SAMPLES);
+    const uint8_t *played = samples;
+    size_t loaded;
+
+    outbuf_read(&player->out, samples, len);
+    if (player->clip.remaining > 0)
+        played = play_clip(player, samples, len);
+    meter_block(&player->meter, played, len);
+    if (player->echo != NULL)
+        echo_played(player->echo, played, len, esp_timer_get_time() + DAC_PLAY_DELAY_US);
+    ESP_ERROR_CHECK(dac_continuous_write_asynchronously(player->dac_handle, evt->buf, evt->buf_size, played, len, &loaded));
+}
+
+// Queue samples for the DAC, through the clock drift resampler
+static void output(audio_player_t *player, const uint8_t *data, size_t len)
+{
+#if CONFIG_AUDIO_PLAYER_DRIFT_PPM > 0
+    uint8_t resampled[DRIFT_OUT_LEN(DRIFT_CHUNK)];
+
+    while (len > 0)
+    {
+        size_t n = MIN(len, DRIFT_CHUNK);
+        size_t out_len = drift_resample(&player->drift, data, n, resampled);
+
+        outbuf_write(&player->out, resampled, out_len);
+        data += n;
+        len -= n;
+    }
+#else
+    outbuf_write(&player->out, data, len);
+#endif
+}
+
+#if RTP_MAX_SOURCES > 1
+static bool fifos_empty(audio_player_t *player)
+{
+    for (int i = 0; i < RTP_MAX_SOURCES; i++)
+    {
+        if (player->fifos[i].fill > 0)
+            return false;
+    }
+
+    return true;
+}
+
+// Samples that do not fit are dropped: that source is too far ahead of the others
+static void fifo_write(audio_player_t *player, mix_fifo_t *fifo, const uint8_t *data, size_t len)
+{
+    size_t space = MIX_FIFO_LEN - fifo->fill;
+
+    if (len > space)
+    {
+        player->mix_overflows += len - space;
+        len = space;
+    }
+
+    for (size_t done = 0; done < len;)
+    {
+        size_t pos = (fifo->read + fifo->fill) % MIX_FIFO_LEN;
+        size_t n = MIN(len - done, MIX_FIFO_LEN - pos);
+
+        memcpy(fifo->data + pos, data + done, n);
+        fifo->fill += n;
+        done += n;
+    }
+}
+
+// Add up to len samples of a source to the mix, returns how many it had
+static size_t fifo_mix(mix_fifo_t *fifo, int16_t *acc, size_t len)
+{
+    size_t total = MIN(len, fifo->fill);
+
+    for (size_t done = 0; done < total;)
+    {
+        size_t n = MIN(total - done, MIX_FIFO_LEN - fifo->read);
+
+        mixer_add(acc + done, fifo->data + fifo->read, n);
+        fifo->read = (fifo->read + n) % MIX_FIFO_LEN;
+        fifo->fill -= n;
+        done += n;
+    }
+
+    return total;
+}
+
+static void play_mixed(audio_player_t *player)
+{
+    int16_t acc[MIX_FRAME];
+    uint8_t out[MIX_FRAME];
+    size_t len = 0;
+
+    mixer_clear(acc, MIX_FRAME);
+    for (int i = 0; i < RTP_MAX_SOURCES; i++)
+    {
+        size_t n = fifo_mix(&player->fifos[i], acc, MIX_FRAME);
+        if (n > len)
+            len = n;
+    }
+
+    mixer_output(acc, len, out);
+    output(player, out, len);
+    player->mixed_frames++;
+}
+#endif
+
+static void queue_samples(audio_player_t *player, uint8_t source, bool mix, const uint8_t *data, size_t len)
+{
+#if RTP_MAX_SOURCES > 1
+    if (mix)
+    {
+        fifo_write(player, &player->fifos[source], data, len);
+        return;
+    }
+#endif
+
+    output(player, data, len);
+}
+
+// Queue converted samples for the output, or for the mixer input of their source
+static void emit(audio_player_t *player, uint8_t source, bool mix, uint8_t *data, size_t len)
+{
+#if CONFIG_AUDIO_NET_IMPAIR
+    // The sender clock skew, on the samples as the sender delivered them
+    int skew = impair_skew(&player->rtp.impair, len);
+
+    if (skew < 0)
+        len--;
+#endif
+
+    queue_samples(player, source, mix, data, len);
+
+#if CONFIG_AUDIO_NET_IMPAIR
+    if (skew > 0)
+        queue_samples(player, source, mix, data + len - 1, 1);
+#endif
+}
+
+// Play a received payload, bringing reduced rate formats back to the DAC rate
+static void play_payload(audio_player_t *player, uint8_t *buffer, size_t len, uint8_t pt, uint8_t source, bool mix)
+{
+    const payload_format_t *format = payload_format_by_pt(pt);
+    uint8_t upsampled[UPSAMPLE_LEN];
+    plc_t *plc = &player->plc[source];
+
+    plc->packet_len = len * format->decimation;
+
+    if (format->decimation == 1)
+    {
+        plc_received(plc, buffer, len);
+        emit(player, source, mix, buffer, len);
+        player->prev_sample[source] = buffer[len - 1];
+        return;
+    }
+
+    while (len > 0)
+    {
+        size_t n = MIN(len, UPSAMPLE_LEN / format->decimation);
+        size_t out_len = payload_upsample(buffer, n, format->decimation, &player->prev_sample[source], upsampled);
+
+        plc_received(plc, upsampled, out_len);
+        emit(player, source, mix, upsampled, out_len);
+        buffer += n;
+        len -= n;
+    }
+}
+
+// Play a replacement for a missing packet, as long as the previous one
+static void conceal_packet(audio_player_t *player, uint8_t source, bool mix)
+{
+    uint8_t samples[UPSAMPLE_LEN];
+    plc_t *plc = &player->plc[source];
+
+    for (size_t len = plc->packet_len; len > 0;)
+    {
+        size_t n = MIN(len, UPSAMPLE_LEN);
+
+        plc_conceal(plc, samples, n);
+        emit(player, source, mix, samples, n);
+        len -= n;
+    }
+
+    player->prev_sample[source] = plc->history[PLC_HISTORY - 1];
+    player->concealed++;
+}
+
+// Keep the output buffer at its prefill level with comfort noise while the sender is silent
+static void play_comfort_noise(audio_player_t *player)
 {
-    dac_event_data_t evt_data;
-    size_t byte_written = 0;
+    uint8_t noise[UPSAMPLE_LEN];
 
-    while (byte_written < data_size)
+    while (player->out.fill < PREFILL_SAMPLES)
     {
-        xQueueReceive(que, &evt_data, portMAX_DELAY);
-        size_t loaded_bytes = 0;
-        ESP_ERROR_CHECK(dac_continuous_write_asynchronously(handle, evt_data.buf, evt_data.buf_size,
-                                                            data + byte_written, data_size - byte_written, &loaded_bytes));
-        byte_written += loaded_bytes;
+        size_t n = MIN(PREFILL_SAMPLES - player->out.fill, UPSAMPLE_LEN);
+
+        comfort_noise_fill(&player->comfort, noise, n);
+        outbuf_write(&player->out, noise, n);
+        player->comfort_samples += n;
     }
 }
 
+#if CONFIG_AUDIO_SYNC
+// Queue up to len samples of silence, returns how many fit
+static size_t insert_silence(audio_player_t *player, size_t len)
+{
+    uint8_t silence[UPSAMPLE_LEN];
+
+    len = MIN(len, outbuf_space(&player->out));
+    memset(silence, MIXER_SILENCE, MIN(len, UPSAMPLE_LEN));
+
+    for (size_t done = 0; done < len;)
+        done += outbuf_write(&player->out, silence, MIN(len - done, UPSAMPLE_LEN));
+
+    return len;
+}
+
+/*
+ * Line a packet of len samples (before upsampling) up with its playout time.
+ * Its first sample is heard after everything buffered: when that is off by
+ * more than SYNC_TOLERANCE, silence is inserted before it or its start is
+ * dropped. Smaller errors are left to the drift correction. Returns the
+ * number of samples to drop.
+ */
+static size_t schedule_packet(audio_player_t *player, size_t len, uint8_t decimation)
+{
+    player_sync_t *sync = &player->sync;
+    int64_t play_time = rtp_play_time(&player->rtp);
+    size_t skip = 0;
+
+    sync->scheduled = play_time != 0;
+    if (!sync->scheduled)
+        return 0;
+
+    int64_t heard = sync_wallclock(sync->head_time) + ((int64_t)player->out.fill * 1000000) / CONFIG_AUDIO_SAMPLE_RATE;
+    int64_t early = ((play_time - heard) * CONFIG_AUDIO_SAMPLE_RATE) / 1000000;
+
+    if (early > SYNC_TOLERANCE)
+    {
+        size_t n = insert_silence(player, early);
+
+        sync->inserted += n;
+        sync->steps++;
+        early -= n;
+    }
+    else if (-early > SYNC_TOLERANCE)
+    {
+        skip = MIN(len, (-early + decimation - 1) / decimation);
+        sync->dropped += skip * decimation;
+        sync->steps++;
+        early += skip * decimation;
+    }
+
+    // The schedule decides when the output starts, not the prefill
+    player->out.priming = false;
+
+    // What is heard, after the correction
+    int64_t error_us = (early * 1000000) / CONFIG_AUDIO_SAMPLE_RATE;
+    if (sync->packets == 0 || error_us < sync->error_min_us)
+        sync->error_min_us = error_us;
+    if (sync->packets == 0 || error_us > sync->error_max_us)
+        sync->error_max_us = error_us;
+    sync->error_sum_us += error_us;
+    sync->packets++;
+    sync->error = early;
+
+    return skip;
+}
+#endif
+
 static void audio_player_task(void *pvParameters)
 {
     audio_player_t *player = pvParameters;
     uint8_t *buffer;
     size_t len;
+    uint8_t pt;
+    uint8_t source;
+    bool running = true;
 
     // FIXME: Maybe it should always be enabled
     ESP_ERROR_CHECK(dac_continuous_enable(player->dac_handle));
     ESP_ERROR_CHECK(dac_continuous_start_async_writing(player->dac_handle));
 
-    while ((buffer = rtp_next_packet(&player->rtp, &len)) != NULL)
+    while (running)
     {
-        dac_write_data_asynchronously(player->dac_handle, player->que, buffer, len);
+        dac_event_data_t evt;
+
+        // Paced by the DAC: wake up when a DMA buffer has to be loaded again
+        xQueueReceive(player->que, &evt, portMAX_DELAY);
+#if CONFIG_AUDIO_SYNC
+        // The buffer loaded now is heard once the DMA went through the other ones
+        int64_t woken = sched_woken(&player->latency);
+        player->sync.head_time = (woken != 0 ? woken : esp_timer_get_time()) + DAC_PLAY_DELAY_US;
+#endif
+        sched_running(&player->latency);
+
+        if (player->stopping)
+            break;
+
+#if CONFIG_AUDIO_SINGLE_TASK
+        // No receive task: take the datagrams out of the socket here
+        if (player->stream)
+            rtp_poll(&player->rtp);
+#endif
+
+        // Take in everything that arrived since the previous refill
+        while (player->stream && rtp_packet_waiting(&player->rtp))
+        {
+            if ((buffer = rtp_next_packet(&player->rtp, &len, &pt, &source)) == NULL)
+            {
+                running = false;
+                break;
+            }
+
+            if (pt == PAYLOAD_PT_CN)
+            {
+                if (len > 0)
+                    comfort_noise_set(&player->comfort, buffer[0]);
+                continue;
+            }
+            // A lost packet during a silence is covered by the comfort noise
+            if (len == 0 && player->comfort.amplitude > 0)
+                continue;
+            player->comfort.amplitude = 0;
+
+#if RTP_MAX_SOURCES > 1
+            // A single talker goes straight to the output, the mixer only runs while several talk
+            bool mix = rtp_active_sources(&player->rtp) > 1;
+
+            // The other talkers left: what the mixer still holds is played before going direct
+            if (!mix)
+            {
+                while (!fifos_empty(player))
+                    play_mixed(player);
+            }
+#else
+            bool mix = false;
+#endif
+            if (len == 0)
+            {
+                conceal_packet(player, source, mix);
+                continue;
+            }
+
+#if CONFIG_AUDIO_SYNC
+            // Mixed talkers are played as they arrive
+            if (mix)
+            {
+                player->sync.scheduled = false;
+            }
+            else
+            {
+                size_t skip = schedule_packet(player, len, payload_format_by_pt(pt)->decimation);
+
+                buffer += skip;
+                len -= skip;
+                if (len == 0)
+                    continue;
+            }
+#endif
+            play_payload(player, buffer, len, pt, source, mix);
+        }
+
+        // Until the talkspurt starts again, or the sender is gone
+        if (player->comfort.amplitude > 0 && rtp_active_sources(&player->rtp) == 0)
+            player->comfort.amplitude = 0;
+#if RTP_MAX_SOURCES > 1
+        if (player->comfort.amplitude > 0 && fifos_empty(player))
+#else
+        if (player->comfort.amplitude > 0)
+#endif
+            play_comfort_noise(player);
+
+#if RTP_MAX_SOURCES > 1
+        while (player->out.fill < PREFILL_SAMPLES && !fifos_empty(player))
+            play_mixed(player);
+#endif
+
+#if CONFIG_AUDIO_SYNC
+        if (player->sync.scheduled)
+            drift_steer(&player->drift, player->sync.error);
+        else
+#endif
+        if (!player->out.priming)
+            drift_update(&player->drift, player->out.fill);
+
+        // A new clip interrupts the one playing
+        xQueueReceive(player->clip_queue, &player->clip, 0);
+
+        refill(player, &evt);
     }
 
     ESP_ERROR_CHECK(dac_continuous_stop_async_writing(player->dac_handle));
@@ -76,17 +521,54 @@ static void audio_player_task(void *pvParameters)
     uint8_t c = 1;
     xQueueSend(player->stop_queue, &c, 0);
 
+    memstats_task_remove(xTaskGetCurrentTaskHandle());
     player->task_handle = NULL;
     vTaskDelete(NULL);
 }
 
-void audio_player_init(audio_player_t *player)
+/*
+ * With stream false, the player only plays clips: no RTP socket is opened and
+ * nothing received from the network is played.
+ */
+static void player_init(audio_player_t *player, bool stream)
 {
+    memstats_begin(MEM_PLAYER);
+
+    player->stream = stream;
     player->task_handle = NULL;
+    player->concealed = 0;
+    for (int i = 0; i < RTP_MAX_SOURCES; i++)
+    {
+        player->prev_sample[i] = MIXER_SILENCE;
+        plc_init(&player->plc[i]);
+#if RTP_MAX_SOURCES > 1
+        player->fifos[i].read = 0;
+        player->fifos[i].fill = 0;
+#endif
+    }
+#if RTP_MAX_SOURCES > 1
+    player->mixed_frames = 0;
+    player->mix_overflows = 0;
+#endif
+    outbuf_init(&player->out, PREFILL_SAMPLES);
+    drift_init(&player->drift);
+    meter_init(&player->meter);
+    player->late_refills = 0;
+    // The DMA gets back to the buffer after playing the other ones
+    sched_latency_init(&player->latency, DAC_PLAY_DELAY_US);
+    player->echo = NULL;
+    comfort_noise_init(&player->comfort);
+    player->comfort_samples = 0;
+    player->clip.remaining = 0;
+#if CONFIG_AUDIO_SYNC
+    memset(&player->sync, 0, sizeof(player->sync));
+#endif
+    player->clip_queue = xQueueCreate(1, sizeof(player_clip_t));
+    assert(player->clip_queue);
     dac_continuous_config_t cont_cfg = {
         .chan_mask = DAC_CHANNEL_MASK_CH0,
-        .desc_num = 4,
-        .buf_size = 2048,
+        .desc_num = DAC_DESC_NUM,
+        .buf_size = DAC_BUF_SIZE,
         .freq_hz = CONFIG_AUDIO_SAMPLE_RATE,
         .offset = 0,
         .clk_src = DAC_DIGI_CLK_SRC_APLL,
@@ -95,26 +577,84 @@ void audio_player_init(audio_player_t *player)
     /* Allocate continuous channels */
     ESP_ERROR_CHECK(dac_continuous_new_channels(&cont_cfg, &player->dac_handle));
 
-    /* Create a queue to transport the interrupt event data */
-    player->que = xQueueCreate(10, sizeof(dac_event_data_t));
+    /* Create a queue to transport the interrupt event data, at most one per DMA buffer */
+    player->que = xQueueCreate(DAC_DESC_NUM, sizeof(dac_event_data_t));
     assert(player->que);
     dac_event_callbacks_t cbs = {
         .on_convert_done = dac_on_convert_done_callback,
         .on_stop = NULL,
     };
     /* Must register the callback if using asynchronous writing */
-    ESP_ERROR_CHECK(dac_continuous_register_event_callback(player->dac_handle, &cbs, player->que));
+    ESP_ERROR_CHECK(dac_continuous_register_event_callback(player->dac_handle, &cbs, player));
+
+    if (stream)
+        rtp_init(&player->rtp, 5000, RTP_RECV);
 
-    rtp_init(&player->rtp, 5000, RTP_RECV);
+    memstats_end();
 
     ESP_LOGD(TAG, "Audio player initialized at %d Hz", CONFIG_AUDIO_SAMPLE_RATE);
 }
 
+void audio_player_init(audio_player_t *player)
+{
+    player_init(player, true);
+}
+
+// A player for clips alone, while neither talking nor listening
+void audio_player_init_clips(audio_player_t *player)
+{
+    player_init(player, false);
+}
+
+// Report the played audio to the echo suppressor of the recorder, before starting
+void audio_player_set_echo(audio_player_t *player, echo_t *echo)
+{
+    player->echo = echo;
+}
+
+/*
+ * Play a clip over the stream, from the next DMA buffer: mixed with it, or
+ * instead of it until the clip ends. The player must be started.
+ */
+void audio_player_play_clip(audio_player_t *player, const clip_t *clip, bool mix)
+{
+    player_clip_t c = {
+        .samples = clip->samples,
+        .remaining = clip->length,
+        .mix = mix,
+    };
+
+    xQueueOverwrite(player->clip_queue, &c);
+}
+
+/*
+ * The queue is checked first: the player task copies a clip out of it before
+ * the queue looks empty, so a clip being taken is seen in one place or the
+ * other.
+ */
+bool audio_player_clip_playing(audio_player_t *player)
+{
+    if (uxQueueMessagesWaiting(player->clip_queue) > 0)
+        return true;
+
+    return player->clip.remaining > 0;
+}
+
 esp_err_t audio_player_start(audio_player_t *player)
 {
+    memstats_begin(MEM_PLAYER);
+
     player->stop_queue = xQueueCreate(1, sizeof(uint8_t));
-    rtp_start(&player->rtp);
-    return xTaskCreate(audio_player_task, "audio_player", 4096, player, 5, &player->task_handle);
+    player->stopping = false;
+    if (player->stream)
+        rtp_start(&player->rtp);
+    BaseType_t ret = sched_task_create(SCHED_PLAYER, audio_player_task, "audio_player", PLAYER_TASK_STACK, player, &player->task_handle);
+    if (ret == pdPASS)
+        memstats_task_add(player->task_handle, PLAYER_TASK_STACK);
+
+    memstats_end();
+
+    return ret;
 }
 
 bool audio_player_playing(audio_player_t *player)
@@ -124,15 +664,86 @@ bool audio_player_playing(audio_player_t *player)
 
 void audio_player_stop(audio_player_t *player)
 {
-    rtp_stop(&player->rtp);
+    memstats_begin(MEM_PLAYER);
+
     uint8_t c;
-    xQueueReceive(player->stop_queue, &c, portMAX_DELAY);
+    if (!player->stream)
+    {
+        // Checked at every refill
+        player->stopping = true;
+        xQueueReceive(player->stop_queue, &c, portMAX_DELAY);
+    }
+    else
+    {
+#if CONFIG_AUDIO_SINGLE_TASK
+        // The player task receives the packets itself, it must be done before the socket is closed
+        player->stopping = true;
+        xQueueReceive(player->stop_queue, &c, portMAX_DELAY);
+        rtp_stop(&player->rtp);
+#else
+        rtp_stop(&player->rtp);
+        xQueueReceive(player->stop_queue, &c, portMAX_DELAY);
+#endif
+    }
     vQueueDelete(player->stop_queue);
+
+    memstats_end();
+}
+
+void audio_player_log_stats(audio_player_t *player)
+{
+    outbuf_t *ob = &player->out;
+
+    if (player->stream)
+        rtp_log_stats(&player->rtp);
+
+    ESP_LOGI(TAG, "Output underruns: %" PRIu32 ", late refills: %" PRIu32 ", samples dropped: %" PRIu32 ", silence: %" PRIu64 " ms",
+             ob->underruns, player->late_refills, ob->overruns, ((uint64_t)ob->silence * 1000) / CONFIG_AUDIO_SAMPLE_RATE);
+    if (ob->level_max > 0)
+        ESP_LOGI(TAG, "Output buffer level min: %d ms, max: %d ms (prefill %d ms)",
+                 (ob->level_min * 1000) / CONFIG_AUDIO_SAMPLE_RATE, (ob->level_max * 1000) / CONFIG_AUDIO_SAMPLE_RATE,
+                 (PREFILL_SAMPLES * 1000) / CONFIG_AUDIO_SAMPLE_RATE);
+    uint32_t concealed_samples = 0;
+    for (int i = 0; i < RTP_MAX_SOURCES; i++)
+        concealed_samples += player->plc[i].samples;
+    ESP_LOGI(TAG, "Missing packets concealed: %" PRIu32 " (%" PRIu64 " ms)",
+             player->concealed, ((uint64_t)concealed_samples * 1000) / CONFIG_AUDIO_SAMPLE_RATE);
+    // Of what the DAC played since the stream started: concealed samples, and silence or dropped samples in the stream
+    uint64_t errors = concealed_samples + ob->gaps + ob->overruns;
+    uint64_t total = ob->played + ob->gaps;
+    ESP_LOGI(TAG, "Audio errors: %" PRIu64 " per mille of the samples played",
+             total ? (errors * 1000) / total : 0);
+    if (player->comfort_samples > 0)
+        ESP_LOGI(TAG, "Comfort noise played: %" PRIu64 " ms", ((uint64_t)player->comfort_samples * 1000) / CONFIG_AUDIO_SAMPLE_RATE);
+    sched_latency_log(&player->latency, "Player");
+#if CONFIG_AUDIO_SYNC
+    player_sync_t *sync = &player->sync;
+
+    sync_clock_log();
+    if (sync->packets > 0)
+        ESP_LOGI(TAG, "Playout vs schedule avg: %" PRId64 " us, min: %" PRId64 " us, max: %" PRId64 " us (positive: early), corrections: %" PRIu32 " (silence: %" PRIu64 " ms, dropped: %" PRIu64 " ms)",
+                 sync->error_sum_us / sync->packets, sync->error_min_us, sync->error_max_us, sync->steps,
+                 ((uint64_t)sync->inserted * 1000) / CONFIG_AUDIO_SAMPLE_RATE, ((uint64_t)sync->dropped * 1000) / CONFIG_AUDIO_SAMPLE_RATE);
+    else
+        ESP_LOGW(TAG, "Playout not synchronized yet");
+#endif
+    drift_log_stats(&player->drift);
+    meter_log(&player->meter, "Output");
+
+#if RTP_MAX_SOURCES > 1
+    ESP_LOGI(TAG, "Mixed frames: %" PRIu32 ", samples dropped by the mixer: %" PRIu32, player->mixed_frames, player->mix_overflows);
+#endif
 }
 
 void audio_player_deinit(audio_player_t *player)
 {
+    memstats_begin(MEM_PLAYER);
+
     vQueueDelete(player->que);
+    vQueueDelete(player->clip_queue);
     dac_continuous_del_channels(player->dac_handle);
-    rtp_deinit(&player->rtp);
+    if (player->stream)
+        rtp_deinit(&player->rtp);
+
+    memstats_end();
 }
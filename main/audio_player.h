@@ -14,19 +14,92 @@
 
 #include <driver/dac_continuous.h>
 
+#include "clip.h"
+#include "drift.h"
+#include "echo.h"
+#include "meter.h"
+#include "outbuf.h"
+#include "plc.h"
 #include "rtp.h"
+#include "sched.h"
+#include "vad.h"
+
+#if RTP_MAX_SOURCES > 1
+// Samples of one source waiting to be mixed, at the DAC rate
+#define MIX_FIFO_LEN 4096
+
+typedef struct mix_fifo
+{
+    uint8_t data[MIX_FIFO_LEN];
+    size_t read;
+    size_t fill;
+} mix_fifo_t;
+#endif
+
+// A clip played from flash, over the stream
+typedef struct player_clip
+{
+    const uint8_t *samples;
+    volatile size_t remaining; // Read by audio_player_clip_playing from another task
+    bool mix; // Mixed with the stream, instead of replacing it
+} player_clip_t;
+
+#if CONFIG_AUDIO_SYNC
+// Playout of the packets at their wallclock time
+typedef struct player_sync
+{
+    int64_t head_time;    // When the first buffered sample is heard, in esp_timer time
+    bool scheduled;       // The last packet had a playout time
+    int32_t error;        // How early the last packet is heard, in samples
+    uint32_t packets;     // Played with a playout time
+    int64_t error_sum_us;
+    int64_t error_min_us;
+    int64_t error_max_us;
+    uint32_t steps;       // Errors beyond the tolerance, corrected at once
+    uint32_t inserted;    // Samples of silence inserted by the steps
+    uint32_t dropped;     // Samples dropped by the steps
+} player_sync_t;
+#endif
 
 typedef struct audio_player
 {
     dac_continuous_handle_t dac_handle;
     QueueHandle_t que;
     QueueHandle_t stop_queue;
+    volatile bool stopping;
+    bool stream; // Plays the RTP stream, see audio_player_init_clips
     TaskHandle_t task_handle;
+    uint8_t prev_sample[RTP_MAX_SOURCES]; // Last played sample per source, upsampling starts from it
+    plc_t plc[RTP_MAX_SOURCES];
+    uint32_t concealed;                   // Missing packets concealed
+    outbuf_t out;
+    drift_t drift;
+    meter_t meter;
+    volatile uint32_t late_refills; // DMA buffers replayed because they were not loaded in time
+    sched_latency_t latency;        // From the DAC interrupt to the refill
+    echo_t *echo;                   // Told what is played, in full duplex
+    comfort_noise_t comfort;        // Played during the silences of the sender
+    uint32_t comfort_samples;
+    QueueHandle_t clip_queue;       // Next clip to play, from audio_player_play_clip
+    player_clip_t clip;
+#if CONFIG_AUDIO_SYNC
+    player_sync_t sync;
+#endif
     rtp_t rtp;
+#if RTP_MAX_SOURCES > 1
+    mix_fifo_t fifos[RTP_MAX_SOURCES];
+    uint32_t mixed_frames;
+    uint32_t mix_overflows; // Samples dropped because a source was too far ahead of the others
+#endif
 } audio_player_t;
 
 void audio_player_init(audio_player_t *player);
+void audio_player_init_clips(audio_player_t *player);
+void audio_player_set_echo(audio_player_t *player, echo_t *echo);
+void audio_player_play_clip(audio_player_t *player, const clip_t *clip, bool mix);
+bool audio_player_clip_playing(audio_player_t *player);
 esp_err_t audio_player_start(audio_player_t *player);
 bool audio_player_playing(audio_player_t *player);
 void audio_player_stop(audio_player_t *player);
+void audio_player_log_stats(audio_player_t *player);
 void audio_player_deinit(audio_player_t *player);
\ No newline at end of file
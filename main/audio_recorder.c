@@ -5,16 +5,35 @@
  */
 
 #include "audio_recorder.h"
+#include "adc_unpack.h"
+#include "memstats.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <sdkconfig.h>
 #include <stdint.h>
+#include <sys/param.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #define ADC_BIT_WIDTH 12 // (8 might is not supported) FIXME: Could read 12 bits per sample and encode on 16 bit audio. TBD
 
+_Static_assert(SOC_ADC_DIGI_RESULT_BYTES == ADC_UNPACK_RESULT_BYTES, "Unexpected ADC DMA result size");
+_Static_assert(SOC_ADC_CHANNEL_NUM(ADC_UNIT_1) == ADC_UNPACK_CHANNELS, "Unexpected ADC1 channel count");
+
+#if CONFIG_AUDIO_SINGLE_TASK
+// One DMA frame per packet: the ADC notifications pace the stream, the packets are sent from this task
+#define ADC_READ_LEN (((CONFIG_AUDIO_SAMPLE_RATE * CONFIG_AUDIO_RTP_PTIME_MS) / 1000) * SOC_ADC_DIGI_RESULT_BYTES)
+#else
 #define ADC_READ_LEN 1388 * SOC_ADC_DIGI_RESULT_BYTES // Read a complete RTP packet at once
+#endif
+
+// Stack depth is in bytes, the task keeps the ADC results on its stack, the samples are converted into the RTP packets
+#if CONFIG_AUDIO_SINGLE_TASK
+#define RECORDER_TASK_STACK (4096 + (ADC_READ_LEN) + RTP_SEND_STACK)
+#else
+#define RECORDER_TASK_STACK (4096 + (ADC_READ_LEN))
+#endif
 
 static adc_channel_t channel = ADC_CHANNEL_6; // VDET_1 / GPIO34
 
@@ -23,8 +42,10 @@ static const char *TAG = "audio_recorder";
 
 static bool IRAM_ATTR s_conv_done_cb(adc_continuous_handle_t handle, const adc_continuous_evt_data_t *edata, void *user_data)
 {
+    audio_recorder_t *recorder = user_data;
     BaseType_t mustYield = pdFALSE;
 
+    sched_wake(&recorder->latency);
     vTaskNotifyGiveFromISR(s_task_handle, &mustYield);
 
     return (mustYield == pdTRUE);
@@ -32,8 +53,15 @@ static bool IRAM_ATTR s_conv_done_cb(adc_continuous_handle_t handle, const adc_c
 
 void audio_recorder_init(audio_recorder_t *recorder)
 {
+    memstats_begin(MEM_RECORDER);
+
     recorder->task_handle = NULL;
     recorder->adc_handle = NULL;
+    recorder->echo = NULL;
+    // The ADC driver only keeps one frame
+    sched_latency_init(&recorder->latency, ((int64_t)ADC_READ_LEN / SOC_ADC_DIGI_RESULT_BYTES * 1000000) / CONFIG_AUDIO_SAMPLE_RATE);
+    siggen_init(&recorder->siggen, SIGGEN_NONE);
+    meter_init(&recorder->meter);
 
     rtp_init(&recorder->rtp, 5000, RTP_SEND);
 
@@ -63,6 +91,8 @@ void audio_recorder_init(audio_recorder_t *recorder)
 
     dig_cfg.adc_pattern = &adc_pattern;
     ESP_ERROR_CHECK(adc_continuous_config(recorder->adc_handle, &dig_cfg));
+
+    memstats_end();
 }
 
 void audio_recorder_task(void *data)
@@ -70,8 +100,9 @@ void audio_recorder_task(void *data)
     esp_err_t ret;
     uint32_t ret_num = 0;
 
-    uint8_t result[ADC_READ_LEN] = {0};
-    uint8_t raw_data[ADC_READ_LEN / 2] = {0};
+    // Word aligned for adc_unpack_8
+    uint8_t result[ADC_READ_LEN] __attribute__((aligned(4))) = {0};
+    uint16_t last = 0x800;
 
     audio_recorder_t *recorder = data;
 
@@ -81,7 +112,7 @@ void audio_recorder_task(void *data)
         .on_conv_done = s_conv_done_cb,
     };
 
-    ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(recorder->adc_handle, &cbs, NULL));
+    ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(recorder->adc_handle, &cbs, recorder));
     ESP_ERROR_CHECK(adc_continuous_start(recorder->adc_handle));
 
     while (1)
@@ -95,20 +126,35 @@ void audio_recorder_task(void *data)
 
         if (ret == ESP_OK)
         {
-            for (int i = 0; i < ret_num; i += SOC_ADC_DIGI_RESULT_BYTES)
+            sched_running(&recorder->latency);
+
+            const uint8_t *in = result;
+            size_t remaining = ret_num / SOC_ADC_DIGI_RESULT_BYTES;
+            int64_t now = esp_timer_get_time();
+
+            // Convert straight into the payload of the RTP packets, a packet may end in the middle of the read
+            while (remaining > 0)
             {
-                adc_digi_output_data_t *p = (void *)&result[i];
-                uint32_t chan_num = p->type1.channel;
-                uint32_t data = p->type1.data;
-                /* Check the channel number validation, the data is invalid if the channel num exceed the maximum channel */
-                if (chan_num < SOC_ADC_CHANNEL_NUM(ADC_UNIT_1))
-                {
-                    // Currently only working with 8 bits samples, so only keeping 8 of the 12 data bits (MSB)
-                    raw_data[i / SOC_ADC_DIGI_RESULT_BYTES] = (data >> 4);
-                }
-            }
+                size_t space;
+                uint8_t *samples = rtp_send_buffer(&recorder->rtp, &space);
+                size_t len = MIN(remaining, space);
+
+                // Currently only working with 8 bits samples, so only keeping 8 of the 12 data bits (MSB)
+                adc_unpack_8(in, len, samples, &last);
+                in += len * SOC_ADC_DIGI_RESULT_BYTES;
+                remaining -= len;
 
-            rtp_push_data(&recorder->rtp, raw_data, ret_num / SOC_ADC_DIGI_RESULT_BYTES);
+                if (recorder->siggen.type != SIGGEN_NONE)
+                    siggen_fill(&recorder->siggen, samples, len);
+
+                meter_block(&recorder->meter, samples, len);
+
+                // Test signals are not picked up by the speaker, leave them untouched
+                if (recorder->echo != NULL && recorder->siggen.type == SIGGEN_NONE)
+                    echo_capture(recorder->echo, samples, len, now - ((int64_t)remaining * 1000000) / CONFIG_AUDIO_SAMPLE_RATE);
+
+                rtp_send_commit(&recorder->rtp, len);
+            }
         }
         else if (ret == ESP_ERR_TIMEOUT)
         {
@@ -122,16 +168,35 @@ void audio_recorder_task(void *data)
     uint8_t c = 1;
     xQueueSend(recorder->stop_queue, &c, 0);
 
+    memstats_task_remove(xTaskGetCurrentTaskHandle());
     recorder->task_handle = NULL;
     vTaskDelete(NULL);
 }
 
+void audio_recorder_set_test_signal(audio_recorder_t *recorder, enum siggen_type type)
+{
+    siggen_init(&recorder->siggen, type);
+}
+
+void audio_recorder_set_echo(audio_recorder_t *recorder, echo_t *echo)
+{
+    recorder->echo = echo;
+}
+
 esp_err_t audio_recorder_start(audio_recorder_t *recorder)
 {
+    memstats_begin(MEM_RECORDER);
+
     recorder->stopping = 0;
     recorder->stop_queue = xQueueCreate(1, sizeof(uint8_t));
     rtp_start(&recorder->rtp);
-    return xTaskCreate(audio_recorder_task, "audio_recorder", 4096 + (ADC_READ_LEN * sizeof(StackType_t)), recorder, 5, &recorder->task_handle);
+    BaseType_t ret = sched_task_create(SCHED_RECORDER, audio_recorder_task, "audio_recorder", RECORDER_TASK_STACK, recorder, &recorder->task_handle);
+    if (ret == pdPASS)
+        memstats_task_add(recorder->task_handle, RECORDER_TASK_STACK);
+
+    memstats_end();
+
+    return ret;
 }
 
 bool audio_recorder_recording(audio_recorder_t *recorder)
@@ -141,15 +206,31 @@ bool audio_recorder_recording(audio_recorder_t *recorder)
 void audio_recorder_stop(audio_recorder_t *recorder)
 {
     uint8_t c = 1;
+
+    memstats_begin(MEM_RECORDER);
+
     recorder->stopping = 1;
     xQueueReceive(recorder->stop_queue, &c, portMAX_DELAY);
     rtp_stop(&recorder->rtp);
 
     vQueueDelete(recorder->stop_queue);
+
+    memstats_end();
+}
+
+void audio_recorder_log_stats(audio_recorder_t *recorder)
+{
+    rtp_log_stats(&recorder->rtp);
+    sched_latency_log(&recorder->latency, "Recorder");
+    meter_log(&recorder->meter, "Capture");
 }
 
 void audio_recorder_deinit(audio_recorder_t *recorder)
 {
+    memstats_begin(MEM_RECORDER);
+
     ESP_ERROR_CHECK(adc_continuous_deinit(recorder->adc_handle));
     rtp_deinit(&recorder->rtp);
+
+    memstats_end();
 }
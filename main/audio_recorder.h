@@ -13,7 +13,11 @@
 #include <freertos/queue.h>
 #include <esp_adc/adc_continuous.h>
 
+#include "echo.h"
+#include "meter.h"
 #include "rtp.h"
+#include "sched.h"
+#include "siggen.h"
 
 typedef struct audio_recorder
 {
@@ -21,11 +25,18 @@ typedef struct audio_recorder
     QueueHandle_t stop_queue;
     bool stopping;
     TaskHandle_t task_handle;
+    siggen_t siggen;
+    meter_t meter;
+    echo_t *echo; // Suppresses the played audio from the capture, in full duplex
+    sched_latency_t latency; // From the ADC interrupt to the read
     rtp_t rtp;
 } audio_recorder_t;
 
 void audio_recorder_init(audio_recorder_t *recorder);
+void audio_recorder_set_test_signal(audio_recorder_t *recorder, enum siggen_type type);
+void audio_recorder_set_echo(audio_recorder_t *recorder, echo_t *echo);
 esp_err_t audio_recorder_start(audio_recorder_t *recorder);
 bool audio_recorder_recording(audio_recorder_t *recorder);
 void audio_recorder_stop(audio_recorder_t *recorder);
+void audio_recorder_log_stats(audio_recorder_t *recorder);
 void audio_recorder_deinit(audio_recorder_t *recorder);
\ No newline at end of file
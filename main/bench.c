@@ -0,0 +1,510 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "bench.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sdkconfig.h>
+#include <esp_cpu.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "adc_unpack.h"
+#include "meter.h"
+#include "mixer.h"
+#include "payload.h"
+#include "plc.h"
+#include "udp.h"
+
+static const char *TAG = "bench";
+
+// 93 ms at 44.1 kHz, long enough for the sweep to cover the voice band
+#define BENCH_LEN 4096
+#define BENCH_RUNS 8
+#define BENCH_SOURCES 4
+
+// Peak of the reference signals, in 8 bit steps from silence
+#define BENCH_AMPLITUDE 100.0f
+// Samples left out of the SNR at both ends, while the stages settle
+#define BENCH_SKIP 16
+#define BENCH_SILENCE 128
+// Channel of the microphone, see audio_recorder.c
+#define BENCH_ADC_CHANNEL 6
+
+#define FRAME_LEN ((CONFIG_AUDIO_SAMPLE_RATE * CONFIG_AUDIO_RTP_PTIME_MS) / 1000)
+
+#define LOAD_PERIOD_MS 2000
+#define LOAD_MAX_TASKS 32
+
+#define BURST_MAX 32
+#define BURST_ROUNDS 10
+#define BURST_PORT 5000
+#define BURST_SSRC 0x62757273
+// For the last packets to get through the receive path
+#define BURST_SETTLE_MS 200
+
+typedef struct bench_signal
+{
+    const char *name;
+    float (*fn)(float t);
+} bench_signal_t;
+
+typedef struct bench_work
+{
+    int16_t *acc;
+    uint8_t *tmp;
+    uint8_t *adc; // The input as ADC DMA results
+    uint8_t *silence;
+    meter_t meter;
+    plc_t *plc;
+} bench_work_t;
+
+typedef struct bench_stage
+{
+    const char *name;
+    // NULL for the capture itself, whose only loss is the 8 bit quantization
+    void (*run)(const uint8_t *in, uint8_t *out, bench_work_t *work);
+    bool output;   // Whether the stage produces audio to compare
+    float delay;   // In samples, for the reference to line up with the output
+    size_t memory; // Bytes kept or used as scratch for one packet
+    size_t window; // Samples compared at the end of the output, 0 for the whole output
+} bench_stage_t;
+
+// Linear sweep from 100 Hz to 8 kHz over the benchmark
+static float sweep(float t)
+{
+    const float f0 = 100.0f;
+    const float f1 = 8000.0f;
+    const float len = (float)BENCH_LEN / CONFIG_AUDIO_SAMPLE_RATE;
+
+    return sinf(2.0f * (float)M_PI * (f0 * t + (f1 - f0) * t * t / (2.0f * len)));
+}
+
+/*
+ * Voiced speech stand-in: a 120 Hz glottal pulse train shaped by the
+ * formants of an /a/ vowel, up to 4 kHz.
+ */
+static float vowel(float t)
+{
+    static const float formants[3][3] = {
+        // Frequency, bandwidth, gain
+        {700.0f, 130.0f, 1.0f},
+        {1220.0f, 70.0f, 0.5f},
+        {2600.0f, 160.0f, 0.25f},
+    };
+    const float f0 = 120.0f;
+    float sum = 0.0f;
+
+    for (int h = 1; h * f0 <= 4000.0f; h++)
+    {
+        float f = h * f0;
+        float gain = 0.0f;
+
+        for (int i = 0; i < 3; i++)
+        {
+            float d = (f - formants[i][0]) / formants[i][1];
+            gain += formants[i][2] / (1.0f + d * d);
+        }
+
+        sum += gain / h * sinf(2.0f * (float)M_PI * f * t);
+    }
+
+    return sum;
+}
+
+static const bench_signal_t signals[] = {
+    {"sweep", sweep},
+    {"vowel", vowel},
+};
+
+static void stage_rate(const uint8_t *in, uint8_t *out, bench_work_t *work, uint8_t factor)
+{
+    uint8_t prev = BENCH_SILENCE;
+    size_t len = payload_decimate(in, BENCH_LEN, factor, work->tmp);
+
+    payload_upsample(work->tmp, len, factor, &prev, out);
+}
+
+static void stage_half(const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    stage_rate(in, out, work, 2);
+}
+
+static void stage_quarter(const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    stage_rate(in, out, work, 4);
+}
+
+static void stage_adc_reference(const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    uint16_t last = 0;
+
+    adc_unpack_8_reference(work->adc, BENCH_LEN, out, &last);
+}
+
+static void stage_adc(const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    uint16_t last = 0;
+
+    adc_unpack_8(work->adc, BENCH_LEN, out, &last);
+}
+
+// The talker mixed with silent ones, which must not change the audio
+static void stage_mix(const uint8_t *in, uint8_t *out, bench_work_t *work, int sources)
+{
+    mixer_clear(work->acc, BENCH_LEN);
+    mixer_add(work->acc, in, BENCH_LEN);
+    for (int s = 1; s < sources; s++)
+        mixer_add(work->acc, work->silence, BENCH_LEN);
+    mixer_output(work->acc, BENCH_LEN, out);
+}
+
+static void stage_mix1(const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    stage_mix(in, out, work, 1);
+}
+
+static void stage_mix2(const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    stage_mix(in, out, work, 2);
+}
+
+static void stage_mix4(const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    stage_mix(in, out, work, BENCH_SOURCES);
+}
+
+// The last packet is lost and concealed
+static void stage_plc(const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    plc_init(work->plc);
+    memcpy(out, in, BENCH_LEN - FRAME_LEN);
+    plc_received(work->plc, out, BENCH_LEN - FRAME_LEN);
+    plc_conceal(work->plc, out + BENCH_LEN - FRAME_LEN, FRAME_LEN);
+}
+
+static void stage_meter(const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    meter_block(&work->meter, in, BENCH_LEN);
+}
+
+/*
+ * The decimation averages over factor samples and the interpolation lands on
+ * each average at the end of its group, which delays the audio by
+ * (factor - 1) / 2 samples.
+ */
+static const bench_stage_t stages[] = {
+    {"L8 capture", NULL, true, 0.0f, 0, 0},
+    {"ADC unpack, ref", stage_adc_reference, true, 0.0f, 0, 0},
+    {"ADC unpack", stage_adc, true, 0.0f, 0, 0},
+    {"half rate", stage_half, true, 0.5f, 1 + FRAME_LEN / 2, 0},
+    {"quarter rate", stage_quarter, true, 1.5f, 1 + FRAME_LEN / 4, 0},
+    {"mixer, 1 source", stage_mix1, true, 0.0f, FRAME_LEN * sizeof(int16_t), 0},
+    {"mixer, 2 sources", stage_mix2, true, 0.0f, FRAME_LEN * sizeof(int16_t), 0},
+    {"mixer, 4 sources", stage_mix4, true, 0.0f, FRAME_LEN * sizeof(int16_t), 0},
+    // Only the concealed packet, the rest is a copy of the input
+    {"1 packet lost", stage_plc, true, 0.0f, sizeof(plc_t), FRAME_LEN},
+    {"level meter", stage_meter, false, 0.0f, sizeof(meter_t), 0},
+};
+
+static float reference(const bench_signal_t *signal, float scale, float n)
+{
+    return scale * signal->fn(n / CONFIG_AUDIO_SAMPLE_RATE);
+}
+
+// Signal to noise ratio of the output of a stage against the reference, in dB
+static float snr(const bench_signal_t *signal, float scale, const bench_stage_t *stage, const uint8_t *out)
+{
+    float power = 0.0f;
+    float noise = 0.0f;
+    float delay = stage->delay;
+    int start = BENCH_SKIP;
+    int end = BENCH_LEN - BENCH_SKIP;
+
+    if (stage->window > 0)
+    {
+        start = BENCH_LEN - stage->window;
+        end = BENCH_LEN;
+    }
+
+    for (int n = start; n < end; n++)
+    {
+        float r = reference(signal, scale, n - delay);
+        float e = (float)((int)out[n] - BENCH_SILENCE) - r;
+
+        power += r * r;
+        noise += e * e;
+    }
+
+    if (noise == 0.0f)
+        return INFINITY;
+
+    return 10.0f * log10f(power / noise);
+}
+
+/*
+ * Kernels are timed over BENCH_LEN samples, keeping the fastest of BENCH_RUNS
+ * runs so that interrupts and cache misses do not count.
+ */
+static uint32_t measure(const bench_stage_t *stage, const uint8_t *in, uint8_t *out, bench_work_t *work)
+{
+    uint32_t best = UINT32_MAX;
+
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        uint32_t start = esp_cpu_get_cycle_count();
+
+        stage->run(in, out, work);
+
+        uint32_t cycles = esp_cpu_get_cycle_count() - start;
+        if (cycles < best)
+            best = cycles;
+    }
+
+    return best;
+}
+
+static void report(const bench_stage_t *stage, const bench_signal_t *signal, float quality, uint32_t cycles)
+{
+    char snr_text[16] = "-";
+    char cycles_text[16] = "-";
+    char load_text[16] = "-";
+
+    if (stage->output)
+        snprintf(snr_text, sizeof(snr_text), "%.1f", quality);
+
+    if (stage->run != NULL)
+    {
+        // Hundredths of cycles per sample and of CPU load at the sample rate
+        uint32_t per_sample = (cycles * 100) / BENCH_LEN;
+        uint64_t load = ((uint64_t)cycles * CONFIG_AUDIO_SAMPLE_RATE * 100) / ((uint64_t)BENCH_LEN * CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ * 10000);
+
+        snprintf(cycles_text, sizeof(cycles_text), "%" PRIu32 ".%02" PRIu32, per_sample / 100, per_sample % 100);
+        snprintf(load_text, sizeof(load_text), "%" PRIu64 ".%02" PRIu64, load / 100, load % 100);
+    }
+
+    printf("| %-16s | %-6s | %6s | %13s | %5s | %5u |\n",
+           stage->name, signal->name, snr_text, cycles_text, load_text, (unsigned)stage->memory);
+}
+
+/*
+ * Runs the reference signals through each stage of the audio path and prints
+ * its quality against its cost, as a markdown table to keep with the commit
+ * that changes a stage.
+ */
+void bench_run(void)
+{
+    uint8_t *in = malloc(BENCH_LEN);
+    uint8_t *out = malloc(BENCH_LEN);
+    bench_work_t work = {
+        .acc = malloc(BENCH_LEN * sizeof(*work.acc)),
+        .tmp = malloc(BENCH_LEN),
+        .adc = malloc(BENCH_LEN * ADC_UNPACK_RESULT_BYTES),
+        .silence = malloc(BENCH_LEN),
+        .plc = malloc(sizeof(plc_t)),
+    };
+
+    if (in == NULL || out == NULL || work.acc == NULL || work.tmp == NULL || work.adc == NULL || work.silence == NULL || work.plc == NULL)
+    {
+        ESP_LOGE(TAG, "Not enough memory to run the benchmarks");
+        goto done;
+    }
+
+    memset(work.silence, BENCH_SILENCE, BENCH_LEN);
+    meter_init(&work.meter);
+
+    ESP_LOGI(TAG, "%d samples, best of %d runs, at %d Hz and %d MHz, memory for %d samples packets",
+             BENCH_LEN, BENCH_RUNS, CONFIG_AUDIO_SAMPLE_RATE, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, FRAME_LEN);
+    printf("| stage            | signal | SNR dB | cycles/sample | %% CPU | bytes |\n");
+    printf("|------------------|--------|--------|---------------|-------|-------|\n");
+
+    for (int i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+    {
+        const bench_signal_t *signal = &signals[i];
+        float peak = 0.0f;
+
+        for (int n = 0; n < BENCH_LEN; n++)
+            peak = fmaxf(peak, fabsf(signal->fn((float)n / CONFIG_AUDIO_SAMPLE_RATE)));
+
+        float scale = BENCH_AMPLITUDE / peak;
+
+        for (int n = 0; n < BENCH_LEN; n++)
+            in[n] = BENCH_SILENCE + lrintf(reference(signal, scale, n));
+
+        // The 8 bit samples as the 4 MSB of the 12 data bits dropped by the capture
+        for (int n = 0; n < BENCH_LEN; n++)
+        {
+            uint16_t result = (BENCH_ADC_CHANNEL << 12) | (in[n] << 4) | (n & 0xf);
+
+            work.adc[2 * n] = result & 0xff;
+            work.adc[2 * n + 1] = result >> 8;
+        }
+
+        for (int j = 0; j < sizeof(stages) / sizeof(stages[0]); j++)
+        {
+            const bench_stage_t *stage = &stages[j];
+            uint32_t cycles = 0;
+
+            memcpy(out, in, BENCH_LEN);
+            if (stage->run != NULL)
+                cycles = measure(stage, in, out, &work);
+
+            report(stage, signal, snr(signal, scale, stage, out), cycles);
+        }
+    }
+
+done:
+    free(in);
+    free(out);
+    free(work.acc);
+    free(work.tmp);
+    free(work.adc);
+    free(work.silence);
+    free(work.plc);
+}
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+/*
+ * CPU time used by each task while streaming, in percent of one core. This
+ * compares the cost of the task layouts, see CONFIG_AUDIO_SINGLE_TASK.
+ */
+void bench_load(void)
+{
+    TaskStatus_t *before = malloc(LOAD_MAX_TASKS * sizeof(*before));
+    TaskStatus_t *after = malloc(LOAD_MAX_TASKS * sizeof(*after));
+    uint32_t start, end;
+
+    if (before == NULL || after == NULL)
+    {
+        ESP_LOGE(TAG, "Not enough memory to measure the load");
+        goto done;
+    }
+
+    UBaseType_t count_before = uxTaskGetSystemState(before, LOAD_MAX_TASKS, &start);
+    vTaskDelay(pdMS_TO_TICKS(LOAD_PERIOD_MS));
+    UBaseType_t count_after = uxTaskGetSystemState(after, LOAD_MAX_TASKS, &end);
+
+    if (count_before == 0 || count_after == 0 || end == start)
+    {
+        ESP_LOGE(TAG, "Too many tasks to measure the load");
+        goto done;
+    }
+
+    ESP_LOGI(TAG, "CPU load over %d ms, in %% of one core:", LOAD_PERIOD_MS);
+    for (UBaseType_t i = 0; i < count_after; i++)
+    {
+        for (UBaseType_t j = 0; j < count_before; j++)
+        {
+            if (before[j].xHandle != after[i].xHandle)
+                continue;
+
+            // Hundredths of percent
+            uint64_t load = ((uint64_t)(after[i].ulRunTimeCounter - before[j].ulRunTimeCounter) * 10000) / (end - start);
+            if (load > 0)
+                ESP_LOGI(TAG, "%-16s %3" PRIu64 ".%02" PRIu64 " %%", after[i].pcTaskName, load / 100, load % 100);
+            break;
+        }
+    }
+
+done:
+    free(before);
+    free(after);
+}
+#else
+void bench_load(void)
+{
+    ESP_LOGE(TAG, "Measuring the load needs CONFIG_FREERTOS_USE_TRACE_FACILITY and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS");
+}
+#endif
+
+int bench_sender_open(bench_sender_t *sender)
+{
+    sender->seq = 0;
+    sender->ts = 0;
+
+    if (audio_udp_init(&sender->udp, BURST_PORT) != 0)
+        return -1;
+    sender->udp.dest_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    return 0;
+}
+
+// Send count silent packets back to back, returns how many the stack took
+uint32_t bench_send_burst(bench_sender_t *sender, int count)
+{
+    uint8_t packet[RTP_HEADER_LEN + FRAME_LEN];
+    struct rtp_header *hdr = (struct rtp_header *)packet;
+    uint32_t sent = 0;
+
+    memset(packet, 0, RTP_HEADER_LEN);
+    memset(packet + RTP_HEADER_LEN, BENCH_SILENCE, FRAME_LEN);
+    hdr->version = 2;
+    hdr->pt = PAYLOAD_PT_L8;
+    hdr->ssrc = htonl(BURST_SSRC);
+
+    for (int i = 0; i < count; i++)
+    {
+        hdr->sequence_number = htons(sender->seq++);
+        hdr->ts = htonl(sender->ts);
+        sender->ts += FRAME_LEN;
+
+        if (udp_send_bytes(&sender->udp, packet, sizeof(packet)) > 0)
+            sent++;
+    }
+
+    return sent;
+}
+
+void bench_sender_close(bench_sender_t *sender)
+{
+    udp_stop(&sender->udp);
+}
+
+/*
+ * Sends bursts of 1 to BURST_MAX packets to the player through the loopback
+ * interface, like Wi-Fi delivering the packets it held during retries at
+ * once, and reports how many of them the receive path took in. The bursts are
+ * spaced so that the average rate is the stream one. Run while talking, with
+ * nobody else sending.
+ */
+void bench_burst(rtp_t *rtp)
+{
+    bench_sender_t sender;
+
+    if (bench_sender_open(&sender) != 0)
+        return;
+
+    ESP_LOGI(TAG, "%d bursts of each size, %d ms packets, %d packet buffers",
+             BURST_ROUNDS, CONFIG_AUDIO_RTP_PTIME_MS, CONFIG_AUDIO_RTP_RECV_BURST_PACKETS);
+    printf("| burst | sent | received | dropped | buffers full |\n");
+    printf("|-------|------|----------|---------|--------------|\n");
+
+    for (int burst = 1; burst <= BURST_MAX; burst *= 2)
+    {
+        uint32_t packets = rtp->stats.packets;
+        uint32_t stalls = rtp->stats.recv_stalls;
+        uint32_t sent = 0;
+
+        for (int round = 0; round < BURST_ROUNDS; round++)
+        {
+            sent += bench_send_burst(&sender, burst);
+            vTaskDelay(pdMS_TO_TICKS(burst * CONFIG_AUDIO_RTP_PTIME_MS));
+        }
+        vTaskDelay(pdMS_TO_TICKS(BURST_SETTLE_MS));
+
+        uint32_t received = rtp->stats.packets - packets;
+
+        printf("| %5d | %4" PRIu32 " | %8" PRIu32 " | %7" PRIu32 " | %12" PRIu32 " |\n",
+               burst, sent, received, sent - received, rtp->stats.recv_stalls - stalls);
+    }
+
+    bench_sender_close(&sender);
+}
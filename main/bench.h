@@ -0,0 +1,25 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "rtp.h"
+#include "udp.h"
+
+// Sends silent RTP packets to the player through the loopback interface
+typedef struct bench_sender
+{
+    udp_t udp;
+    uint16_t seq;
+    uint32_t ts;
+} bench_sender_t;
+
+void bench_run(void);
+void bench_load(void);
+void bench_burst(rtp_t *rtp);
+int bench_sender_open(bench_sender_t *sender);
+uint32_t bench_send_burst(bench_sender_t *sender, int count);
+void bench_sender_close(bench_sender_t *sender);
@@ -0,0 +1,124 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "clip.h"
+
+#include <string.h>
+#include <sdkconfig.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+
+static const char *TAG = "clip";
+
+#define CLIP_PARTITION "clips"
+
+_Static_assert(sizeof(clip_header_t) == 16, "Wrong clip header size");
+_Static_assert(sizeof(clip_entry_t) == 24, "Wrong clip entry size");
+
+// The partition stays mapped once opened
+static const uint8_t *clips;
+static size_t clips_size;
+
+static const clip_entry_t *entries(void)
+{
+    return (const clip_entry_t *)(clips + sizeof(clip_header_t));
+}
+
+esp_err_t clips_open(void)
+{
+    esp_partition_mmap_handle_t handle;
+    const void *data;
+
+    if (clips != NULL)
+        return ESP_OK;
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CLIP_PARTITION);
+    if (partition == NULL)
+    {
+        ESP_LOGE(TAG, "No %s partition", CLIP_PARTITION);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &data, &handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Cannot map the %s partition: %s", CLIP_PARTITION, esp_err_to_name(err));
+        return err;
+    }
+
+    const clip_header_t *header = data;
+    if (memcmp(header->magic, CLIP_MAGIC, sizeof(header->magic)) != 0 || header->version != CLIP_VERSION)
+    {
+        ESP_LOGE(TAG, "The %s partition has no clips, see tools/mkclips.py", CLIP_PARTITION);
+        err = ESP_ERR_INVALID_VERSION;
+    }
+    else if (header->sample_rate != CONFIG_AUDIO_SAMPLE_RATE)
+    {
+        ESP_LOGE(TAG, "Clips are sampled at %" PRIu32 " Hz instead of %d Hz", header->sample_rate, CONFIG_AUDIO_SAMPLE_RATE);
+        err = ESP_ERR_INVALID_ARG;
+    }
+    else if (sizeof(clip_header_t) + header->count * sizeof(clip_entry_t) > partition->size)
+    {
+        ESP_LOGE(TAG, "The clip index is larger than the partition");
+        err = ESP_ERR_INVALID_SIZE;
+    }
+
+    if (err != ESP_OK)
+    {
+        esp_partition_munmap(handle);
+        return err;
+    }
+
+    clips = data;
+    clips_size = partition->size;
+
+    return ESP_OK;
+}
+
+esp_err_t clip_find(const char *name, clip_t *clip)
+{
+    if (clips_open() != ESP_OK)
+        return ESP_ERR_INVALID_STATE;
+
+    const clip_header_t *header = (const clip_header_t *)clips;
+
+    for (int i = 0; i < header->count; i++)
+    {
+        const clip_entry_t *e = &entries()[i];
+
+        if (strncmp(e->name, name, CLIP_NAME_LEN) != 0)
+            continue;
+
+        if (e->offset > clips_size || e->length > clips_size - e->offset)
+        {
+            ESP_LOGE(TAG, "Clip %s is out of the partition", name);
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        clip->samples = clips + e->offset;
+        clip->length = e->length;
+
+        return ESP_OK;
+    }
+
+    return ESP_ERR_NOT_FOUND;
+}
+
+void clips_log(void)
+{
+    if (clips_open() != ESP_OK)
+        return;
+
+    const clip_header_t *header = (const clip_header_t *)clips;
+
+    for (int i = 0; i < header->count; i++)
+    {
+        const clip_entry_t *e = &entries()[i];
+
+        ESP_LOGI(TAG, "%-*.*s %6" PRIu64 " ms", CLIP_NAME_LEN, CLIP_NAME_LEN, e->name,
+                 ((uint64_t)e->length * 1000) / CONFIG_AUDIO_SAMPLE_RATE);
+    }
+}
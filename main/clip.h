@@ -0,0 +1,51 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+/*
+ * Audio clips (chimes, tones, messages) stored in the "clips" flash partition.
+ *
+ * The partition starts with an index: a header, then one entry per clip with
+ * its name and the place of its samples in the partition. The samples are 8
+ * bit unsigned mono (L8) at CONFIG_AUDIO_SAMPLE_RATE. The whole partition is
+ * memory mapped once, so that a clip is found by scanning the index and
+ * played straight from flash, without being loaded in RAM. The image is built
+ * by tools/mkclips.py, all fields are little endian.
+ */
+#define CLIP_MAGIC "CLIP"
+#define CLIP_VERSION 1
+#define CLIP_NAME_LEN 16
+
+typedef struct clip_header
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t count;
+    uint32_t sample_rate;
+    uint32_t reserved;
+} clip_header_t;
+
+typedef struct clip_entry
+{
+    char name[CLIP_NAME_LEN]; // NUL padded
+    uint32_t offset;          // From the start of the partition
+    uint32_t length;          // In samples
+} clip_entry_t;
+
+typedef struct clip
+{
+    const uint8_t *samples;
+    size_t length;
+} clip_t;
+
+esp_err_t clips_open(void);
+esp_err_t clip_find(const char *name, clip_t *clip);
+void clips_log(void);
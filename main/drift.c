@@ -0,0 +1,143 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "drift.h"
+
+#include <string.h>
+#include <sdkconfig.h>
+#include <esp_log.h>
+
+static const char *TAG = "drift";
+
+#define SILENCE 128
+// Smoothing of the buffer level, 1/256 per refill
+#define LEVEL_SHIFT 8
+// Refills before the smoothed level is used as the target
+#define SETTLE_UPDATES (1 << LEVEL_SHIFT)
+#define PPM_PER_SAMPLE 2
+#define MAX_PPM CONFIG_AUDIO_PLAYER_DRIFT_PPM
+
+void drift_init(drift_t *drift)
+{
+    memset(drift, 0, sizeof(*drift));
+    drift->target = -1;
+    drift->step = DRIFT_ONE;
+    drift->prev = SILENCE;
+}
+
+static void set_ppm(drift_t *drift, int32_t ppm)
+{
+    if (ppm > MAX_PPM)
+        ppm = MAX_PPM;
+    else if (ppm < -MAX_PPM)
+        ppm = -MAX_PPM;
+
+    drift->ppm = ppm;
+    drift->step = DRIFT_ONE + ((int64_t)DRIFT_ONE * ppm) / 1000000;
+
+    if (ppm < drift->ppm_min)
+        drift->ppm_min = ppm;
+    if (ppm > drift->ppm_max)
+        drift->ppm_max = ppm;
+}
+
+// Called once per refill with the buffer level, while playing
+void drift_update(drift_t *drift, size_t level)
+{
+    if (drift->steered)
+    {
+        // The schedule is gone, settle on a buffer level again
+        drift->steered = false;
+        drift->updates = 0;
+        drift->target = -1;
+    }
+
+    if (drift->updates++ == 0)
+        drift->level = (int32_t)level << LEVEL_SHIFT;
+    else
+        drift->level += (int32_t)level - (drift->level >> LEVEL_SHIFT);
+
+    if (drift->target < 0)
+    {
+        if (drift->updates >= SETTLE_UPDATES)
+            drift->target = drift->level >> LEVEL_SHIFT;
+        return;
+    }
+
+    set_ppm(drift, ((drift->level >> LEVEL_SHIFT) - drift->target) * PPM_PER_SAMPLE);
+}
+
+/*
+ * Called once per refill instead of drift_update while the packets have a
+ * playout time (CONFIG_AUDIO_SYNC), with how early the output is on it, in
+ * samples. The smoothed error replaces the distance to the target level: the
+ * output is pulled onto the schedule instead of holding its latency.
+ */
+void drift_steer(drift_t *drift, int32_t error)
+{
+    if (!drift->steered)
+    {
+        drift->steered = true;
+        drift->updates = 0;
+    }
+
+    if (drift->updates++ == 0)
+        drift->level = error * (1 << LEVEL_SHIFT);
+    else
+        drift->level += error - (drift->level >> LEVEL_SHIFT);
+
+    // Early: more samples are needed to reach the schedule
+    set_ppm(drift, -(drift->level >> LEVEL_SHIFT) * PPM_PER_SAMPLE);
+}
+
+/*
+ * Resample by 1 / (1 + ppm / 10^6). out must have room for
+ * DRIFT_OUT_LEN(length) samples. Returns the number of output samples.
+ */
+size_t drift_resample(drift_t *drift, const uint8_t *in, size_t length, uint8_t *out)
+{
+    uint32_t phase = drift->phase;
+    int32_t a = drift->prev;
+    size_t n = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        int32_t b = in[i];
+
+        while (phase < DRIFT_ONE)
+        {
+            out[n++] = a + (int32_t)(((int64_t)(b - a) * phase) >> 24);
+            phase += drift->step;
+        }
+
+        phase -= DRIFT_ONE;
+        a = b;
+    }
+
+    drift->phase = phase;
+    drift->prev = a;
+    drift->in += length;
+    drift->out += n;
+
+    return n;
+}
+
+void drift_log_stats(drift_t *drift)
+{
+    if (MAX_PPM == 0)
+        return;
+
+    if (drift->target < 0 && !drift->steered)
+    {
+        ESP_LOGI(TAG, "Clock drift: measuring the buffer level");
+        return;
+    }
+
+    ESP_LOGI(TAG, "Clock drift correction: %" PRId32 " ppm (min %" PRId32 ", max %" PRId32 "), samples %s: %" PRIu64,
+             drift->ppm, drift->ppm_min, drift->ppm_max,
+             drift->out >= drift->in ? "added" : "removed",
+             drift->out >= drift->in ? drift->out - drift->in : drift->in - drift->out);
+}
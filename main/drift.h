@@ -0,0 +1,51 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Compensation of the clock drift between the sender and the DAC.
+ *
+ * When the sender clock is faster than the DAC one, the output buffer slowly
+ * fills up and the latency grows; when it is slower, the buffer runs dry.
+ * The buffer level is smoothed over about 6 s of refills. Its first smoothed
+ * value becomes the target, and the distance to it sets a sample rate
+ * correction, in ppm (2 ppm per sample of distance, up to
+ * CONFIG_AUDIO_PLAYER_DRIFT_PPM). A linear interpolation resampler applies
+ * the correction to the audio going into the buffer, so that the latency
+ * stays within a millisecond or so of where it started whatever the drift.
+ */
+#define DRIFT_ONE (1 << 24) // Resampler phase unit, one input sample
+
+typedef struct drift
+{
+    int32_t target;     // Buffer level to keep, in samples, -1 until known
+    int32_t level;      // Smoothed buffer level, or playout error when steered, in samples << 8
+    bool steered;       // Following a playout schedule, see drift_steer
+    uint32_t updates;
+    int32_t ppm;        // Correction in use, positive when the sender is faster
+    uint32_t step;      // Input samples per output sample, in DRIFT_ONE units
+    uint32_t phase;     // Position of the next output sample after prev, in DRIFT_ONE units
+    uint8_t prev;       // Last input sample
+
+    int32_t ppm_min;
+    int32_t ppm_max;
+    uint64_t in;
+    uint64_t out;
+} drift_t;
+
+// Room to leave in the output of drift_resample for length input samples
+#define DRIFT_OUT_LEN(length) ((length) + (length) / 256 + 2)
+
+void drift_init(drift_t *drift);
+void drift_update(drift_t *drift, size_t level);
+void drift_steer(drift_t *drift, int32_t error);
+size_t drift_resample(drift_t *drift, const uint8_t *in, size_t length, uint8_t *out);
+void drift_log_stats(drift_t *drift);
@@ -0,0 +1,132 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "echo.h"
+
+#include <math.h>
+#include <string.h>
+#include <sdkconfig.h>
+#include <esp_log.h>
+
+static const char *TAG = "echo";
+
+#define SILENCE 128
+#define UNITY_GAIN (1 << 15)
+// Played blocks quieter than this are not worth ducking for
+#define PLAYED_FLOOR 2
+#define TAIL_US (CONFIG_AUDIO_DUPLEX_TAIL_MS * 1000)
+
+// Duck within 1 ms, so that the start of the echo is caught, and release over 20 ms, so that it does not click
+#define ATTACK_STEP (UNITY_GAIN / (CONFIG_AUDIO_SAMPLE_RATE / 1000))
+#define RELEASE_STEP (UNITY_GAIN / (CONFIG_AUDIO_SAMPLE_RATE / 50))
+
+static uint8_t block_peak(const uint8_t *samples, size_t length)
+{
+    uint8_t peak = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        uint8_t level = samples[i] >= SILENCE ? samples[i] - SILENCE : SILENCE - samples[i];
+        if (level > peak)
+            peak = level;
+    }
+
+    return peak;
+}
+
+static uint32_t duration_us(size_t length)
+{
+    return ((uint64_t)length * 1000000) / CONFIG_AUDIO_SAMPLE_RATE;
+}
+
+void echo_init(echo_t *echo)
+{
+    memset(echo, 0, sizeof(*echo));
+    echo->gain = UNITY_GAIN;
+    echo->duck_gain = UNITY_GAIN * powf(10.0f, -CONFIG_AUDIO_DUPLEX_DUCK_DB / 20.0f);
+    echo->threshold = fminf(256.0f * powf(10.0f, -CONFIG_AUDIO_DUPLEX_THRESHOLD_DB / 20.0f), UINT16_MAX);
+}
+
+// Called by the player for each block loaded for the DAC, start_us being when it will be played
+void echo_played(echo_t *echo, const uint8_t *samples, size_t length, int64_t start_us)
+{
+    echo_block_t *block = &echo->played[echo->next];
+
+    // Invalidate the block first, it may be read meanwhile
+    block->end = block->start;
+    block->peak = block_peak(samples, length);
+    block->start = start_us;
+    block->end = start_us + duration_us(length);
+
+    echo->next = (echo->next + 1) % ECHO_BLOCKS;
+}
+
+// Highest peak played between from and to
+static uint8_t played_peak(echo_t *echo, uint32_t from, uint32_t to)
+{
+    uint8_t peak = 0;
+
+    for (int i = 0; i < ECHO_BLOCKS; i++)
+    {
+        echo_block_t *block = &echo->played[i];
+
+        if ((int32_t)(block->end - from) > 0 && (int32_t)(to - block->start) > 0 && block->peak > peak)
+            peak = block->peak;
+    }
+
+    return peak;
+}
+
+// Called by the recorder for each captured block, end_us being when its last sample was captured
+void echo_capture(echo_t *echo, uint8_t *samples, size_t length, int64_t end_us)
+{
+    uint32_t end = end_us;
+    uint32_t start = end - duration_us(length);
+    uint8_t played = played_peak(echo, start - TAIL_US, end);
+    uint16_t target = UNITY_GAIN;
+
+    echo->blocks++;
+
+    if (played >= PLAYED_FLOOR)
+    {
+        if (block_peak(samples, length) * 256 >= played * echo->threshold)
+        {
+            echo->double_talk++;
+        }
+        else
+        {
+            target = echo->duck_gain;
+            echo->ducked++;
+        }
+    }
+
+    if (target == UNITY_GAIN && echo->gain == UNITY_GAIN)
+        return;
+
+    int32_t gain = echo->gain;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (gain > target)
+            gain = gain - ATTACK_STEP > target ? gain - ATTACK_STEP : target;
+        else if (gain < target)
+            gain = gain + RELEASE_STEP < target ? gain + RELEASE_STEP : target;
+
+        samples[i] = SILENCE + (((int32_t)samples[i] - SILENCE) * gain) / UNITY_GAIN;
+    }
+
+    echo->gain = gain;
+}
+
+void echo_log_stats(echo_t *echo)
+{
+    if (echo->blocks == 0)
+        return;
+
+    ESP_LOGI(TAG, "Captured blocks: %" PRIu32 ", ducked: %" PRIu32 " (%" PRIu32 " %%), double talk: %" PRIu32 " (%" PRIu32 " %%)",
+             echo->blocks, echo->ducked, (echo->ducked * 100) / echo->blocks,
+             echo->double_talk, (echo->double_talk * 100) / echo->blocks);
+}
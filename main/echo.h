@@ -0,0 +1,52 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Echo suppression for full duplex, where the speaker is also the microphone.
+ *
+ * The player records the peak of each block it sends to the DAC, with the
+ * time it will be played. While a block was played during the capture of a
+ * block (or up to CONFIG_AUDIO_DUPLEX_TAIL_MS before), the capture is ducked
+ * by CONFIG_AUDIO_DUPLEX_DUCK_DB, unless it is louder than the played peak
+ * minus CONFIG_AUDIO_DUPLEX_THRESHOLD_DB: someone is then talking at this
+ * end too (Geigel double talk detection) and the capture is let through.
+ *
+ * The player and the recorder tasks run concurrently: the played blocks are
+ * stored without a lock, a block read while being written only skews one
+ * decision.
+ */
+#define ECHO_BLOCKS 16
+
+typedef struct echo_block
+{
+    volatile uint32_t start; // Play time, in us (wrapping)
+    volatile uint32_t end;
+    volatile uint8_t peak;
+} echo_block_t;
+
+typedef struct echo
+{
+    echo_block_t played[ECHO_BLOCKS];
+    uint8_t next;
+    uint16_t gain;      // Applied to the capture, 1 << 15 is unity
+    uint16_t duck_gain;
+    uint16_t threshold; // Of the played peak for double talk, 1 << 8 is unity
+
+    uint32_t blocks;
+    uint32_t ducked;
+    uint32_t double_talk;
+} echo_t;
+
+void echo_init(echo_t *echo);
+void echo_played(echo_t *echo, const uint8_t *samples, size_t length, int64_t start_us);
+void echo_capture(echo_t *echo, uint8_t *samples, size_t length, int64_t end_us);
+void echo_log_stats(echo_t *echo);
@@ -0,0 +1,233 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "fec.h"
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "rtp.h"
+
+struct fec_header
+{
+    uint16_t seq_base;
+    uint8_t group_size;
+    uint8_t mark_pt_xor; // Marker bit, then the 7 payload type bits
+    uint32_t media_ssrc;
+    uint32_t ts_xor;
+    uint16_t len_xor;
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct fec_header) == FEC_HEADER_LEN, "Wrong FEC header size");
+
+static void group_start(fec_group_t *g, uint16_t seq_base)
+{
+    g->seq_base = seq_base;
+    g->received = 0;
+    g->active = true;
+    g->has_parity = false;
+    g->ts_xor = 0;
+    g->len_xor = 0;
+    g->pt_xor = 0;
+    g->mark_xor = 0;
+    g->max_len = 0;
+    g->present = 0;
+    memset(g->header, 0, sizeof(g->header));
+    memset(g->acc, 0, sizeof(g->acc));
+}
+
+static void group_xor(fec_group_t *g, const uint8_t *data, size_t len)
+{
+    if (len > FEC_MAX_PAYLOAD)
+        len = FEC_MAX_PAYLOAD;
+
+    for (size_t i = 0; i < len; i++)
+        g->acc[i] ^= data[i];
+
+    if (len > g->max_len)
+        g->max_len = len;
+}
+
+void fec_encoder_init(fec_encoder_t *enc, uint32_t ssrc)
+{
+    enc->group.active = false;
+    enc->ssrc = ssrc;
+    enc->seq = 0;
+}
+
+/*
+ * Add a sent media packet to the current group. Once the group is complete,
+ * the parity packet is written to fec_packet and its length returned.
+ */
+size_t fec_encoder_add(fec_encoder_t *enc, const uint8_t *packet, size_t len, uint8_t *fec_packet)
+{
+    const struct rtp_header *hdr = (const struct rtp_header *)packet;
+    uint16_t seq = ntohs(hdr->sequence_number);
+    uint16_t seq_base = seq - seq % FEC_GROUP;
+    fec_group_t *g = &enc->group;
+
+    if (!g->active || g->seq_base != seq_base)
+        group_start(g, seq_base);
+
+    group_xor(g, packet + RTP_HEADER_LEN, len - RTP_HEADER_LEN);
+    g->ts_xor ^= hdr->ts;
+    g->len_xor ^= len - RTP_HEADER_LEN;
+    g->pt_xor ^= hdr->pt;
+    g->mark_xor ^= hdr->mark;
+    g->received++;
+    memcpy(g->header, packet, RTP_HEADER_LEN);
+
+    if (seq % FEC_GROUP != FEC_GROUP - 1)
+        return 0;
+
+    struct rtp_header *fec_hdr = (struct rtp_header *)fec_packet;
+    memcpy(fec_hdr, g->header, RTP_HEADER_LEN);
+    fec_hdr->pt = FEC_PT;
+    fec_hdr->mark = 0;
+    fec_hdr->sequence_number = htons(enc->seq++);
+    fec_hdr->ssrc = htonl(enc->ssrc);
+
+    struct fec_header *f = (struct fec_header *)(fec_packet + RTP_HEADER_LEN);
+    f->seq_base = htons(seq_base);
+    f->group_size = FEC_GROUP;
+    f->mark_pt_xor = (g->mark_xor << 7) | g->pt_xor;
+    f->media_ssrc = hdr->ssrc;
+    f->ts_xor = g->ts_xor;
+    f->len_xor = htons(g->len_xor);
+    memcpy(fec_packet + RTP_HEADER_LEN + FEC_HEADER_LEN, g->acc, g->max_len);
+
+    g->active = false;
+
+    return RTP_HEADER_LEN + FEC_HEADER_LEN + g->max_len;
+}
+
+void fec_decoder_init(fec_decoder_t *dec)
+{
+    memset(dec, 0, sizeof(*dec));
+}
+
+/*
+ * The slot of a group, restarted when the group is newer than the one it
+ * holds. A late packet of an older group returns NULL: it must not wipe the
+ * group in progress in the same slot.
+ */
+static fec_group_t *decoder_group(fec_decoder_t *dec, uint16_t seq_base)
+{
+    fec_group_t *g = &dec->groups[(seq_base / FEC_GROUP) % 2];
+
+    if (g->active && g->seq_base == seq_base)
+        return g;
+
+    if (g->active && (int16_t)(seq_base - g->seq_base) < 0)
+        return NULL;
+
+    group_start(g, seq_base);
+
+    return g;
+}
+
+void fec_decoder_add_media(fec_decoder_t *dec, const uint8_t *packet, size_t len)
+{
+    const struct rtp_header *hdr = (const struct rtp_header *)packet;
+    uint16_t seq = ntohs(hdr->sequence_number);
+    fec_group_t *g = decoder_group(dec, seq - seq % FEC_GROUP);
+    uint8_t bit = 1 << (seq % FEC_GROUP);
+
+    if (g == NULL || (g->present & bit))
+        return;
+
+    group_xor(g, packet + RTP_HEADER_LEN, len - RTP_HEADER_LEN);
+    g->ts_xor ^= hdr->ts;
+    g->len_xor ^= len - RTP_HEADER_LEN;
+    g->pt_xor ^= hdr->pt;
+    g->mark_xor ^= hdr->mark;
+    g->present |= bit;
+    g->received++;
+    memcpy(g->header, packet, RTP_HEADER_LEN);
+}
+
+// The stream a parity packet protects
+int fec_parity_media_ssrc(const uint8_t *packet, size_t len, uint32_t *ssrc)
+{
+    if (len < RTP_HEADER_LEN + FEC_HEADER_LEN)
+        return -EINVAL;
+
+    const struct fec_header *f = (const struct fec_header *)(packet + RTP_HEADER_LEN);
+    *ssrc = ntohl(f->media_ssrc);
+
+    return 0;
+}
+
+int fec_decoder_add_parity(fec_decoder_t *dec, const uint8_t *packet, size_t len)
+{
+    if (len < RTP_HEADER_LEN + FEC_HEADER_LEN)
+        return -EINVAL;
+
+    const struct fec_header *f = (const struct fec_header *)(packet + RTP_HEADER_LEN);
+    if (f->group_size != FEC_GROUP)
+        return -EINVAL;
+
+    fec_group_t *g = decoder_group(dec, ntohs(f->seq_base));
+    if (g == NULL)
+        return -ETIME;
+    if (g->has_parity)
+        return -EALREADY;
+
+    group_xor(g, packet + RTP_HEADER_LEN + FEC_HEADER_LEN, len - RTP_HEADER_LEN - FEC_HEADER_LEN);
+    g->ts_xor ^= f->ts_xor;
+    g->len_xor ^= ntohs(f->len_xor);
+    g->pt_xor ^= f->mark_pt_xor & 0x7f;
+    g->mark_xor ^= f->mark_pt_xor >> 7;
+    g->has_parity = true;
+
+    return 0;
+}
+
+// Whether the packet is the only one missing in its group and the parity was received
+bool fec_decoder_can_recover(fec_decoder_t *dec, uint16_t seq)
+{
+    uint16_t seq_base = seq - seq % FEC_GROUP;
+    fec_group_t *g = &dec->groups[(seq_base / FEC_GROUP) % 2];
+    uint8_t bit = 1 << (seq % FEC_GROUP);
+
+    if (!g->active || g->seq_base != seq_base || !g->has_parity)
+        return false;
+
+    if (g->received != FEC_GROUP - 1 || (g->present & bit))
+        return false;
+
+    return g->len_xor <= g->max_len;
+}
+
+/*
+ * Rebuild the packet with the given sequence number, see fec_decoder_can_recover().
+ * Returns the length of the rebuilt packet or 0.
+ */
+size_t fec_decoder_recover(fec_decoder_t *dec, uint16_t seq, uint8_t *packet)
+{
+    uint16_t seq_base = seq - seq % FEC_GROUP;
+    fec_group_t *g = &dec->groups[(seq_base / FEC_GROUP) % 2];
+    uint8_t bit = 1 << (seq % FEC_GROUP);
+
+    if (!fec_decoder_can_recover(dec, seq))
+        return 0;
+
+    // What is left in the accumulators is the missing packet
+    struct rtp_header *hdr = (struct rtp_header *)packet;
+    memcpy(hdr, g->header, RTP_HEADER_LEN);
+    hdr->sequence_number = htons(seq);
+    hdr->ts = g->ts_xor;
+    hdr->pt = g->pt_xor;
+    hdr->mark = g->mark_xor;
+    memcpy(packet + RTP_HEADER_LEN, g->acc, g->len_xor);
+
+    g->present |= bit;
+    g->received++;
+    dec->recovered++;
+
+    return RTP_HEADER_LEN + g->len_xor;
+}
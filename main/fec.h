@@ -0,0 +1,87 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sdkconfig.h>
+
+#include "payload.h"
+
+/*
+ * XOR parity forward error correction.
+ *
+ * Media packets are grouped by FEC_GROUP consecutive sequence numbers, a group
+ * starting at a multiple of FEC_GROUP. After the last packet of a group, a
+ * parity packet is sent with the FEC payload type. As in RFC 5109, the parity
+ * packets are a separate RTP stream, with their own SSRC and sequence
+ * numbers, so that they do not disturb the media stream for receivers that
+ * do not know about them. Its payload is:
+ *
+ *  0                   1                   2                   3
+ *  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |   first sequence number       |  group size   |M| XOR of PTs  |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |                   SSRC of the media stream                    |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |                    XOR of the timestamps                      |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ * |  XOR of the payload lengths   |  XOR of the payloads ...      |
+ * +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ * M is the XOR of the marker bits. Any single lost packet of a group can be
+ * rebuilt from the other ones and the parity packet, with its own payload type
+ * and marker even when the group mixes comfort noise or rate switches. The overhead is one packet every FEC_GROUP packets.
+ */
+#define FEC_GROUP CONFIG_AUDIO_RTP_FEC_GROUP
+#define FEC_PT PAYLOAD_PT_FEC
+#define FEC_HEADER_LEN 14
+#define FEC_MAX_PAYLOAD 1388
+
+_Static_assert((FEC_GROUP & (FEC_GROUP - 1)) == 0, "The FEC group size must be a power of 2");
+
+typedef struct fec_group
+{
+    uint16_t seq_base;
+    uint8_t received;
+    bool active;
+    bool has_parity;
+    uint32_t ts_xor;
+    uint16_t len_xor;
+    uint8_t pt_xor;
+    uint8_t mark_xor;
+    uint16_t max_len;
+    uint8_t present;
+    uint8_t header[12];
+    uint8_t acc[FEC_MAX_PAYLOAD];
+} fec_group_t;
+
+typedef struct fec_encoder
+{
+    fec_group_t group;
+    uint32_t ssrc; // Of the parity stream
+    uint16_t seq;
+} fec_encoder_t;
+
+typedef struct fec_decoder
+{
+    // The current group and the previous one, whose parity may still be on its way
+    fec_group_t groups[2];
+    uint32_t recovered;
+} fec_decoder_t;
+
+void fec_encoder_init(fec_encoder_t *enc, uint32_t ssrc);
+size_t fec_encoder_add(fec_encoder_t *enc, const uint8_t *packet, size_t len, uint8_t *fec_packet);
+
+void fec_decoder_init(fec_decoder_t *dec);
+void fec_decoder_add_media(fec_decoder_t *dec, const uint8_t *packet, size_t len);
+int fec_parity_media_ssrc(const uint8_t *packet, size_t len, uint32_t *ssrc);
+int fec_decoder_add_parity(fec_decoder_t *dec, const uint8_t *packet, size_t len);
+bool fec_decoder_can_recover(fec_decoder_t *dec, uint16_t seq);
+size_t fec_decoder_recover(fec_decoder_t *dec, uint16_t seq, uint8_t *packet);
@@ -0,0 +1,201 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "impair.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+
+static const char *TAG = "impair";
+
+#define IMPAIR_SEED 0x2545f491
+
+static const impair_profile_t profiles[] = {
+    {
+        .name = "off",
+    },
+    {
+        .name = "loss",
+        .loss = 20,
+    },
+    {
+        .name = "burst",
+        .burst_enter = 10,
+        .burst_leave = 250,
+        .burst_loss = 600,
+    },
+    {
+        .name = "reorder",
+        .reorder = 30,
+    },
+    {
+        .name = "dup",
+        .duplicate = 20,
+    },
+    {
+        .name = "jitter",
+        .jitter = 20,
+        .jitter_max_ms = 80,
+    },
+    {
+        .name = "skew+",
+        .skew_ppm = 500,
+    },
+    {
+        .name = "skew-",
+        .skew_ppm = -500,
+    },
+    {
+        // What we see in apartment buildings: rare random loss, retry storms
+        // delivering bursts after a stall and some reordering.
+        .name = "building",
+        .loss = 5,
+        .burst_enter = 5,
+        .burst_leave = 300,
+        .burst_loss = 500,
+        .reorder = 5,
+        .duplicate = 2,
+        .jitter = 10,
+        .jitter_max_ms = 60,
+        .skew_ppm = 100,
+    },
+};
+
+#define PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+static const impair_profile_t *s_profile = &profiles[0];
+
+int impair_select(const char *name)
+{
+    for (int i = 0; i < PROFILE_COUNT; i++)
+    {
+        if (strcmp(profiles[i].name, name) == 0)
+        {
+            s_profile = &profiles[i];
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+const char *impair_profile_name(unsigned int index)
+{
+    if (index >= PROFILE_COUNT)
+        return NULL;
+
+    return profiles[index].name;
+}
+
+void impair_init(impair_t *imp)
+{
+    memset(imp, 0, sizeof(*imp));
+    imp->profile = s_profile;
+    // Always use the same seed so that a profile can be replayed identically
+    imp->rand_state = IMPAIR_SEED;
+}
+
+static uint32_t next_rand(impair_t *imp)
+{
+    // xorshift32
+    uint32_t x = imp->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    imp->rand_state = x;
+
+    return x;
+}
+
+static bool chance(impair_t *imp, uint16_t per_mille)
+{
+    if (per_mille == 0)
+        return false;
+
+    return (next_rand(imp) % 1000) < per_mille;
+}
+
+enum impair_action impair_next(impair_t *imp, uint32_t *delay_ms)
+{
+    const impair_profile_t *p = imp->profile;
+
+    *delay_ms = 0;
+
+    if (chance(imp, p->jitter))
+    {
+        *delay_ms = 1 + next_rand(imp) % p->jitter_max_ms;
+        imp->stalls++;
+    }
+
+    if (imp->in_burst)
+    {
+        if (chance(imp, p->burst_leave))
+            imp->in_burst = false;
+    }
+    else if (chance(imp, p->burst_enter))
+    {
+        imp->in_burst = true;
+    }
+
+    if (chance(imp, imp->in_burst ? p->burst_loss : p->loss))
+    {
+        imp->dropped++;
+        return IMPAIR_DROP;
+    }
+
+    if (chance(imp, p->duplicate))
+    {
+        imp->duplicated++;
+        return IMPAIR_DUPLICATE;
+    }
+
+    if (chance(imp, p->reorder))
+    {
+        imp->reordered++;
+        return IMPAIR_HOLD;
+    }
+
+    return IMPAIR_PASS;
+}
+
+/*
+ * The sender clock skew over the next length samples of the stream: one
+ * sample is repeated (faster sender, returns 1) or left out (slower sender,
+ * returns -1) every 1e6 / skew_ppm samples, otherwise returns 0.
+ */
+int impair_skew(impair_t *imp, size_t length)
+{
+    int16_t ppm = imp->profile->skew_ppm;
+
+    if (ppm == 0 || length < 2)
+        return 0;
+
+    imp->skew_acc += (int64_t)length * abs(ppm);
+    if (imp->skew_acc < 1000000)
+        return 0;
+
+    imp->skew_acc -= 1000000;
+
+    if (ppm > 0)
+    {
+        imp->skew_added++;
+        return 1;
+    }
+
+    imp->skew_removed++;
+    return -1;
+}
+
+void impair_log_stats(impair_t *imp)
+{
+    ESP_LOGI(TAG, "Profile %s: dropped %" PRIu32 ", duplicated %" PRIu32 ", reordered %" PRIu32 ", stalls %" PRIu32,
+             imp->profile->name, imp->dropped, imp->duplicated, imp->reordered, imp->stalls);
+    if (imp->profile->skew_ppm != 0)
+        ESP_LOGI(TAG, "Clock skew %+d ppm: samples added %" PRIu32 ", removed %" PRIu32,
+                 imp->profile->skew_ppm, imp->skew_added, imp->skew_removed);
+}
@@ -0,0 +1,67 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Network impairment injection for the RTP receive path.
+ *
+ * Packets read from the socket are run through the active profile before
+ * being handed to the player. This allows replaying the same (captured or
+ * synthetic) stream under different network conditions to tune buffering.
+ *
+ * All rates are in per mille. The clock skew is applied by the player to the
+ * samples themselves, once FEC and the jitter buffer rebuilt the packets: a
+ * faster sender delivers more samples than its timestamps say, a slower one
+ * fewer, which is what the drift compensation sees.
+ */
+typedef struct impair_profile
+{
+    const char *name;
+    uint16_t loss;          // Independent random loss
+    uint16_t burst_enter;   // Probability to enter the bursty loss state
+    uint16_t burst_leave;   // Probability to leave the bursty loss state
+    uint16_t burst_loss;    // Loss rate while in the bursty loss state
+    uint16_t reorder;       // Probability to swap a packet with the next one
+    uint16_t duplicate;     // Probability to deliver a packet twice
+    uint16_t jitter;        // Probability to stall the receive path
+    uint16_t jitter_max_ms; // Maximum stall duration
+    int16_t skew_ppm;       // Sender clock offset against the local clock
+} impair_profile_t;
+
+enum impair_action
+{
+    IMPAIR_PASS,
+    IMPAIR_DROP,
+    IMPAIR_DUPLICATE,
+    IMPAIR_HOLD,
+};
+
+typedef struct impair
+{
+    const impair_profile_t *profile;
+    uint32_t rand_state;
+    bool in_burst;
+    int64_t skew_acc;       // Sample fraction owed, in 1e-6 samples
+
+    uint32_t dropped;
+    uint32_t duplicated;
+    uint32_t reordered;
+    uint32_t stalls;
+    uint32_t skew_added;    // Samples synthesized for a faster sender
+    uint32_t skew_removed;  // Samples removed for a slower sender
+} impair_t;
+
+int impair_select(const char *name);
+const char *impair_profile_name(unsigned int index);
+void impair_init(impair_t *imp);
+enum impair_action impair_next(impair_t *imp, uint32_t *delay_ms);
+int impair_skew(impair_t *imp, size_t length);
+void impair_log_stats(impair_t *imp);
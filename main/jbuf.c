@@ -0,0 +1,88 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "jbuf.h"
+
+#include <errno.h>
+#include <string.h>
+
+void jbuf_init(jbuf_t *jb, uint8_t depth)
+{
+    memset(jb, 0, sizeof(*jb));
+    jb->depth = depth < JBUF_SLOTS ? depth : JBUF_SLOTS - 1;
+}
+
+/*
+ * Returns 0 when the packet was stored, -ETIME when it comes after it was
+ * reported missing, -EALREADY for a duplicate and -ENOSPC when it is too far
+ * ahead (the window must then be flushed).
+ */
+int jbuf_insert(jbuf_t *jb, uint16_t seq, void *item)
+{
+    if (!jb->started)
+    {
+        jb->started = true;
+        jb->head = seq;
+        jb->highest = seq;
+    }
+
+    int16_t offset = (int16_t)(seq - jb->head);
+    if (offset < 0)
+        return -ETIME;
+
+    if (offset >= JBUF_SLOTS)
+        return -ENOSPC;
+
+    void **slot = &jb->slots[seq % JBUF_SLOTS];
+    if (*slot != NULL)
+        return -EALREADY;
+
+    *slot = item;
+
+    if ((int16_t)(seq - jb->highest) > 0)
+        jb->highest = seq;
+
+    return 0;
+}
+
+/*
+ * Hand out the next packet in sequence, if any. A missing packet is reported
+ * (with a NULL item) once the window is full, or right away when flushing.
+ */
+enum jbuf_result jbuf_pop(jbuf_t *jb, bool flush, uint16_t *seq, void **item)
+{
+    if (!jb->started || (int16_t)(jb->highest - jb->head) < 0)
+        return JBUF_NONE;
+
+    void **slot = &jb->slots[jb->head % JBUF_SLOTS];
+
+    *seq = jb->head;
+
+    if (*slot != NULL)
+    {
+        *item = *slot;
+        *slot = NULL;
+        jb->head++;
+        return JBUF_PACKET;
+    }
+
+    if (flush || (int16_t)(jb->highest - jb->head) >= jb->depth)
+    {
+        *item = NULL;
+        jb->head++;
+        return JBUF_MISSING;
+    }
+
+    return JBUF_NONE;
+}
+
+// Whether a packet with this sequence number would still be handed out
+bool jbuf_waiting(jbuf_t *jb, uint16_t seq)
+{
+    int16_t offset = (int16_t)(seq - jb->head);
+
+    return jb->started && offset >= 0 && offset < JBUF_SLOTS && jb->slots[seq % JBUF_SLOTS] == NULL;
+}
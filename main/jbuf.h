@@ -0,0 +1,43 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Reorder window for received RTP packets.
+ *
+ * Packets are stored by sequence number and handed out in order. A packet is
+ * handed out as soon as all the previous ones were, so the window only adds
+ * latency when one is missing: it is then waited for until packets up to
+ * `depth` sequence numbers after it were received, before being reported as
+ * missing. This leaves time for reordered or recovered (FEC) packets to arrive.
+ */
+#define JBUF_SLOTS 16
+
+enum jbuf_result
+{
+    JBUF_NONE,
+    JBUF_PACKET,
+    JBUF_MISSING,
+};
+
+typedef struct jbuf
+{
+    void *slots[JBUF_SLOTS];
+    uint16_t head;    // Next sequence number to hand out
+    uint16_t highest; // Highest sequence number received
+    bool started;
+    uint8_t depth;
+} jbuf_t;
+
+void jbuf_init(jbuf_t *jb, uint8_t depth);
+int jbuf_insert(jbuf_t *jb, uint16_t seq, void *item);
+enum jbuf_result jbuf_pop(jbuf_t *jb, bool flush, uint16_t *seq, void **item);
+bool jbuf_waiting(jbuf_t *jb, uint16_t seq);
@@ -7,31 +7,55 @@
 #include <esp_log.h>
 #include <esp_event.h>
 #include <esp_timer.h>
+#include <stdlib.h>
 #include <string.h>
 #include <esp_console.h>
 #include <esp_task.h>
 
 #include "audio_player.h"
 #include "audio_recorder.h"
+#include "bench.h"
+#include "clip.h"
+#include "echo.h"
+#include "memstats.h"
 #include "rtp.h"
+#include "soak.h"
 #include "udp.h"
 #include "wifi.h"
+#if CONFIG_AUDIO_NET_IMPAIR
+#include "impair.h"
+#endif
+#if CONFIG_AUDIO_SYNC
+#include "sync.h"
+#endif
 
 enum state
 {
     TALKING_STATE,
     LISTENING_STATE,
+    DUPLEX_STATE,
     IDLE_STATE
 } state;
 
 audio_player_t player;
 audio_recorder_t recorder;
+echo_t echo;
 
 static const char *TAG = "main";
 
+// The DAC DMA buffers loaded with the end of a clip still have to be played
+#define CLIP_TAIL_MS 200
+
 static void print_stats(void)
 {
     ESP_LOGI(TAG, "Free memory: %lu bytes, Uptime: %" PRId64 " ms", esp_get_free_heap_size(), esp_timer_get_time() / 1000);
+
+    if (state == TALKING_STATE || state == DUPLEX_STATE)
+        audio_player_log_stats(&player);
+    if (state == LISTENING_STATE || state == DUPLEX_STATE)
+        audio_recorder_log_stats(&recorder);
+    if (state == DUPLEX_STATE)
+        echo_log_stats(&echo);
 }
 
 static int run_cmd(int argc, char *argv[])
@@ -46,9 +70,17 @@ static int run_cmd(int argc, char *argv[])
             return -1;
         }
 
+        enum siggen_type signal = SIGGEN_NONE;
+        if (argc > 1 && siggen_parse(argv[1], &signal) != 0)
+        {
+            ESP_LOGE(TAG, "Unknown audio source: %s", argv[1]);
+            return -1;
+        }
+
         ESP_LOGI(TAG, "start listening");
 
         audio_recorder_init(&recorder);
+        audio_recorder_set_test_signal(&recorder, signal);
         audio_recorder_start(&recorder);
         state = LISTENING_STATE;
     }
@@ -66,83 +98,235 @@ static int run_cmd(int argc, char *argv[])
         audio_player_start(&player);
         state = TALKING_STATE;
     }
-    else if (strcmp(cmd, "stop") == 0)
+    else if (strcmp(cmd, "duplex") == 0)
     {
-        ESP_LOGI(TAG, "stop audio");
+        if (state != IDLE_STATE)
+        {
+            ESP_LOGE(TAG, "Already streaming audio. Run stop before");
+            return -1;
+        }
 
-        if (state == TALKING_STATE)
+        enum siggen_type signal = SIGGEN_NONE;
+        if (argc > 1 && siggen_parse(argv[1], &signal) != 0)
         {
-            audio_player_stop(&player);
-            audio_player_deinit(&player);
+            ESP_LOGE(TAG, "Unknown audio source: %s", argv[1]);
+            return -1;
         }
 
-        if (state == LISTENING_STATE)
+        ESP_LOGI(TAG, "start talking and listening");
+
+        echo_init(&echo);
+        audio_player_init(&player);
+        audio_player_set_echo(&player, &echo);
+        audio_recorder_init(&recorder);
+        audio_recorder_set_test_signal(&recorder, signal);
+        audio_recorder_set_echo(&recorder, &echo);
+        // Both directions go through the socket bound to port 5000
+        rtp_share_socket(&recorder.rtp, &player.rtp);
+
+        audio_player_start(&player);
+        audio_recorder_start(&recorder);
+        state = DUPLEX_STATE;
+    }
+    else if (strcmp(cmd, "stop") == 0)
+    {
+        ESP_LOGI(TAG, "stop audio");
+
+        // In duplex, the recorder sends through the socket of the player, stop it first
+        if (state == LISTENING_STATE || state == DUPLEX_STATE)
         {
             audio_recorder_stop(&recorder);
             audio_recorder_deinit(&recorder);
         }
 
+        if (state == TALKING_STATE || state == DUPLEX_STATE)
+        {
+            audio_player_stop(&player);
+            audio_player_deinit(&player);
+        }
+
         state = IDLE_STATE;
     }
     else if (strcmp(cmd, "stats") == 0)
     {
         print_stats();
     }
-    else if (strcmp(cmd, "memtest") == 0)
+    else if (strcmp(cmd, "clip") == 0)
     {
-        const TickType_t xDelay = 100 / portTICK_PERIOD_MS;
-        unsigned int count = 0;
+        clip_t clip;
 
-        while (1)
+        if (argc < 2)
         {
-            ESP_LOGI(TAG, "--------------------- LOOP %u", count++);
-            ESP_LOGI(TAG, "--------------------- start recorder");
-            audio_recorder_init(&recorder);
-            audio_recorder_start(&recorder);
-            vTaskDelay(xDelay);
-            ESP_LOGI(TAG, "--------------------- stop  recorder");
-            audio_recorder_stop(&recorder);
-            audio_recorder_deinit(&recorder);
+            clips_log();
+            return 0;
+        }
 
-            ESP_LOGI(TAG, "--------------------- start player");
-            audio_player_init(&player);
-            audio_player_start(&player);
-            vTaskDelay(xDelay);
-            ESP_LOGI(TAG, "--------------------- stop  player");
-            audio_player_stop(&player);
-            audio_player_deinit(&player);
+        esp_err_t err = clip_find(argv[1], &clip);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Cannot play clip %s: %s", argv[1], esp_err_to_name(err));
+            return -1;
+        }
 
-            print_stats();
+        bool mix = argc > 2 && strcmp(argv[2], "mix") == 0;
+
+        if (state == TALKING_STATE || state == DUPLEX_STATE)
+        {
+            audio_player_play_clip(&player, &clip, mix);
+            return 0;
         }
+
+        if (state != IDLE_STATE)
+        {
+            ESP_LOGE(TAG, "The speaker is not used when listening. Run stop before");
+            return -1;
+        }
+
+        // Run the player for the clip alone, without the network
+        audio_player_init_clips(&player);
+        audio_player_start(&player);
+        audio_player_play_clip(&player, &clip, false);
+        while (audio_player_clip_playing(&player))
+            vTaskDelay(pdMS_TO_TICKS(10));
+        vTaskDelay(pdMS_TO_TICKS(CLIP_TAIL_MS));
+        audio_player_stop(&player);
+        audio_player_deinit(&player);
+    }
+    else if (strcmp(cmd, "mem") == 0)
+    {
+        memstats_log();
+    }
+    else if (strcmp(cmd, "bench") == 0)
+    {
+        if (argc > 1 && strcmp(argv[1], "load") == 0)
+        {
+            bench_load();
+        }
+        else if (argc > 1 && strcmp(argv[1], "burst") == 0)
+        {
+            if (state != TALKING_STATE)
+            {
+                ESP_LOGE(TAG, "Run talk before");
+                return -1;
+            }
+            bench_burst(&player.rtp);
+        }
+        else
+        {
+            bench_run();
+        }
+    }
+#if CONFIG_AUDIO_NET_IMPAIR
+    else if (strcmp(cmd, "impair") == 0)
+    {
+        if (argc < 2)
+        {
+            const char *name;
+            for (unsigned int i = 0; (name = impair_profile_name(i)) != NULL; i++)
+                ESP_LOGI(TAG, "Impairment profile: %s", name);
+            return 0;
+        }
+
+        if (impair_select(argv[1]) != 0)
+        {
+            ESP_LOGE(TAG, "Unknown impairment profile: %s", argv[1]);
+            return -1;
+        }
+
+        // The profile is applied from the next talk command
+        ESP_LOGI(TAG, "Impairment profile set to %s", argv[1]);
+    }
+#endif
+    else if (strcmp(cmd, "soak") == 0)
+    {
+        soak_params_t params = SOAK_DEFAULT_PARAMS;
+
+        if (state != IDLE_STATE)
+        {
+            ESP_LOGE(TAG, "Already streaming audio. Run stop before");
+            return -1;
+        }
+
+        if (argc > 1)
+            params.cycles = atoi(argv[1]);
+        if (argc > 2)
+            params.stream_ms = atoi(argv[2]);
+        if (argc > 3)
+            params.burst = atoi(argv[3]);
+
+        if (params.cycles < 1 || params.cycles > SOAK_MAX_CYCLES || params.stream_ms < CONFIG_AUDIO_RTP_PTIME_MS ||
+            params.stream_ms > SOAK_MAX_STREAM_MS || params.burst > CONFIG_AUDIO_RTP_RECV_BURST_PACKETS)
+        {
+            ESP_LOGE(TAG, "Expected 1 to %d cycles, %d to %d ms streams and up to %d packets per burst",
+                     SOAK_MAX_CYCLES, CONFIG_AUDIO_RTP_PTIME_MS, SOAK_MAX_STREAM_MS, CONFIG_AUDIO_RTP_RECV_BURST_PACKETS);
+            return -1;
+        }
+
+        soak_run(&player, &recorder, &params);
     }
 
     return 0;
 }
 
-static esp_console_cmd_t talk_cmd = {
-    .command = "talk",
-    .help = "Start talking",
-    .func = run_cmd,
-};
-static esp_console_cmd_t listen_cmd = {
-    .command = "listen",
-    .help = "Start listening",
-    .func = run_cmd,
-};
-static esp_console_cmd_t stop_cmd = {
-    .command = "stop",
-    .help = "Stop listening/talking",
-    .func = run_cmd,
-};
-static esp_console_cmd_t stats_cmd = {
-    .command = "stats",
-    .help = "Show stats",
-    .func = run_cmd,
-};
-static esp_console_cmd_t memtest_cmd = {
-    .command = "memtest",
-    .help = "Test Memory",
-    .func = run_cmd,
+static const esp_console_cmd_t commands[] = {
+    {
+        .command = "talk",
+        .help = "Start talking",
+        .func = run_cmd,
+    },
+    {
+        .command = "listen",
+        .help = "Start listening, from the microphone or a test signal",
+        .hint = "[mic|click|chirp]",
+        .func = run_cmd,
+    },
+    {
+        .command = "duplex",
+        .help = "Start talking and listening at the same time, with echo suppression",
+        .hint = "[mic|click|chirp]",
+        .func = run_cmd,
+    },
+    {
+        .command = "stop",
+        .help = "Stop listening/talking",
+        .func = run_cmd,
+    },
+    {
+        .command = "stats",
+        .help = "Show stats",
+        .func = run_cmd,
+    },
+#if CONFIG_AUDIO_NET_IMPAIR
+    {
+        .command = "impair",
+        .help = "List network impairment profiles or select one",
+        .hint = "[profile]",
+        .func = run_cmd,
+    },
+#endif
+    {
+        .command = "clip",
+        .help = "List the audio clips, or play one over the stream (mixed with it or instead of it)",
+        .hint = "[name [mix]]",
+        .func = run_cmd,
+    },
+    {
+        .command = "mem",
+        .help = "Show heap usage per subsystem and audio task stack usage",
+        .func = run_cmd,
+    },
+    {
+        .command = "bench",
+        .help = "Measure the CPU cost of the audio processing kernels, the load of each task while streaming, or the reception of packet bursts while talking",
+        .hint = "[load|burst]",
+        .func = run_cmd,
+    },
+    {
+        .command = "soak",
+        .help = "Start and stop both directions, with packet bursts, and report latency, throughput, heap and stack usage",
+        .hint = "[cycles [stream_ms [burst]]]",
+        .func = run_cmd,
+    },
 };
 
 static esp_err_t start_console(void)
@@ -152,7 +336,7 @@ static esp_err_t start_console(void)
     esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
 
     repl_config.prompt = ">";
-    repl_config.max_cmdline_length = 8;
+    repl_config.max_cmdline_length = 64;
 
     esp_console_dev_uart_config_t hw_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
     err = esp_console_new_repl_uart(&hw_config, &repl_config, &repl);
@@ -162,35 +346,14 @@ static esp_err_t start_console(void)
         return err;
     }
 
-    err = esp_console_cmd_register(&talk_cmd);
-    if (err != ESP_OK)
+    for (int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
     {
-        ESP_LOGE(TAG, "Cannot register console command...");
-        goto deinit_console;
-    }
-    err = esp_console_cmd_register(&listen_cmd);
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Cannot register console command...");
-        goto deinit_console;
-    }
-    err = esp_console_cmd_register(&stop_cmd);
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Cannot register console command...");
-        goto deinit_console;
-    }
-    err = esp_console_cmd_register(&stats_cmd);
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Cannot register console command...");
-        goto deinit_console;
-    }
-    err = esp_console_cmd_register(&memtest_cmd);
-    if (err != ESP_OK)
-    {
-        ESP_LOGE(TAG, "Cannot register console command...");
-        goto deinit_console;
+        err = esp_console_cmd_register(&commands[i]);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Cannot register console command...");
+            goto deinit_console;
+        }
     }
     err = esp_console_start_repl(repl);
     if (err != ESP_OK)
@@ -218,6 +381,9 @@ void app_main(void)
     }
 
     wifi_init();
+#if CONFIG_AUDIO_SYNC
+    sync_clock_start();
+#endif
 
     state = IDLE_STATE;
 
@@ -0,0 +1,255 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "memstats.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_system.h>
+
+static const char *TAG = "memstats";
+
+#define MAX_NESTING 4
+#define MAX_TASKS 8
+
+static const char *subsys_names[MEM_SUBSYS_COUNT] = {
+    [MEM_UDP] = "udp",
+    [MEM_RTP] = "rtp",
+    [MEM_PLAYER] = "player",
+    [MEM_RECORDER] = "recorder",
+};
+
+struct section
+{
+    enum mem_subsys subsys;
+    uint32_t free_before;
+    int32_t nested;
+};
+
+// The sections open in one task
+struct section_stack
+{
+    TaskHandle_t owner;
+    struct section sections[MAX_NESTING];
+    int depth;
+};
+
+struct task_entry
+{
+    char name[configMAX_TASK_NAME_LEN];
+    TaskHandle_t handle;
+    uint32_t stack_size;
+    uint32_t min_free;
+};
+
+// Protects everything below, sections are opened and closed from several tasks
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static struct section_stack stacks[MAX_TASKS];
+static int32_t balance[MEM_SUBSYS_COUNT];
+static int32_t peak[MEM_SUBSYS_COUNT];
+static struct task_entry tasks[MAX_TASKS];
+
+// Called with the lock held
+static struct section_stack *current_stack(bool create)
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    struct section_stack *free_stack = NULL;
+
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        if (stacks[i].owner == self)
+            return &stacks[i];
+        if (stacks[i].owner == NULL && free_stack == NULL)
+            free_stack = &stacks[i];
+    }
+
+    if (create && free_stack != NULL)
+    {
+        free_stack->owner = self;
+        free_stack->depth = 0;
+        return free_stack;
+    }
+
+    return NULL;
+}
+
+// Called with the lock held: the section the current task is in, if any
+static struct section *current_section(void)
+{
+    struct section_stack *st = current_stack(false);
+
+    return st != NULL ? &st->sections[st->depth - 1] : NULL;
+}
+
+void memstats_begin(enum mem_subsys subsys)
+{
+    uint32_t free_before = esp_get_free_heap_size();
+    const char *error = NULL;
+
+    portENTER_CRITICAL(&lock);
+    struct section_stack *st = current_stack(true);
+
+    if (st == NULL)
+        error = "Too many tasks in sections";
+    else if (st->depth == MAX_NESTING)
+        error = "Sections nested too deep";
+    else
+    {
+        st->sections[st->depth].subsys = subsys;
+        st->sections[st->depth].nested = 0;
+        st->sections[st->depth].free_before = free_before;
+        st->depth++;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (error != NULL)
+        ESP_LOGE(TAG, "%s", error);
+}
+
+void memstats_end(void)
+{
+    uint32_t free_after = esp_get_free_heap_size();
+
+    portENTER_CRITICAL(&lock);
+    struct section_stack *st = current_stack(false);
+
+    if (st != NULL)
+    {
+        st->depth--;
+
+        struct section *s = &st->sections[st->depth];
+        int32_t used = (int32_t)(s->free_before - free_after);
+
+        balance[s->subsys] += used - s->nested;
+        if (balance[s->subsys] > peak[s->subsys])
+            peak[s->subsys] = balance[s->subsys];
+
+        if (st->depth > 0)
+            st->sections[st->depth - 1].nested += used;
+        else
+            st->owner = NULL;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+int32_t memstats_balance(enum mem_subsys subsys)
+{
+    portENTER_CRITICAL(&lock);
+    int32_t b = balance[subsys];
+    portEXIT_CRITICAL(&lock);
+
+    return b;
+}
+
+void memstats_task_add(TaskHandle_t handle, uint32_t stack_size)
+{
+    const char *name = pcTaskGetName(handle);
+    struct task_entry *free_entry = NULL;
+    struct task_entry *entry = NULL;
+
+    portENTER_CRITICAL(&lock);
+    struct section *s = current_section();
+
+    // Task memory is freed later by the idle task, outside of any section. Keep it out of the heap balance.
+    if (s != NULL)
+        s->nested += stack_size + sizeof(StaticTask_t);
+
+    for (int i = 0; i < MAX_TASKS && entry == NULL; i++)
+    {
+        if (tasks[i].name[0] == '\0')
+        {
+            if (free_entry == NULL)
+                free_entry = &tasks[i];
+            continue;
+        }
+
+        if (strcmp(tasks[i].name, name) == 0)
+            entry = &tasks[i];
+    }
+
+    if (entry == NULL && free_entry != NULL)
+    {
+        entry = free_entry;
+        strlcpy(entry->name, name, sizeof(entry->name));
+        entry->min_free = stack_size;
+    }
+
+    if (entry != NULL)
+    {
+        entry->handle = handle;
+        entry->stack_size = stack_size;
+    }
+    portEXIT_CRITICAL(&lock);
+
+    if (entry == NULL)
+        ESP_LOGW(TAG, "Too many tasks, not tracking %s", name);
+}
+
+static void update_task(struct task_entry *t)
+{
+    uint32_t free = uxTaskGetStackHighWaterMark(t->handle);
+
+    if (free < t->min_free)
+        t->min_free = free;
+}
+
+void memstats_task_remove(TaskHandle_t handle)
+{
+    portENTER_CRITICAL(&lock);
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        if (tasks[i].handle == handle && tasks[i].name[0] != '\0')
+        {
+            struct section *s = current_section();
+
+            update_task(&tasks[i]);
+
+            // Deleted by another task: the memory is freed right away, in the current section
+            if (handle != xTaskGetCurrentTaskHandle() && s != NULL)
+                s->nested -= tasks[i].stack_size + sizeof(StaticTask_t);
+
+            tasks[i].handle = NULL;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+void memstats_log(void)
+{
+    ESP_LOGI(TAG, "Free heap: %" PRIu32 " bytes, minimum ever: %" PRIu32 " bytes",
+             esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+
+    int32_t balance_copy[MEM_SUBSYS_COUNT];
+    int32_t peak_copy[MEM_SUBSYS_COUNT];
+    struct task_entry tasks_copy[MAX_TASKS];
+
+    // Log from a copy, not with the lock held
+    portENTER_CRITICAL(&lock);
+    for (int i = 0; i < MAX_TASKS; i++)
+        if (tasks[i].name[0] != '\0' && tasks[i].handle != NULL)
+            update_task(&tasks[i]);
+    memcpy(balance_copy, balance, sizeof(balance));
+    memcpy(peak_copy, peak, sizeof(peak));
+    memcpy(tasks_copy, tasks, sizeof(tasks));
+    portEXIT_CRITICAL(&lock);
+
+    for (int i = 0; i < MEM_SUBSYS_COUNT; i++)
+        ESP_LOGI(TAG, "Heap %-8s: %6" PRId32 " bytes in use (approximate), peak %6" PRId32 " bytes", subsys_names[i],
+                 balance_copy[i], peak_copy[i]);
+
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        struct task_entry *t = &tasks_copy[i];
+
+        if (t->name[0] == '\0')
+            continue;
+
+        ESP_LOGI(TAG, "Stack %-16s: %5" PRIu32 " / %5" PRIu32 " bytes used at most%s",
+                 t->name, t->stack_size - t->min_free, t->stack_size, t->handle != NULL ? " (running)" : "");
+    }
+}
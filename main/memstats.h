@@ -0,0 +1,50 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/*
+ * Memory accounting.
+ *
+ * Heap usage is attributed to a subsystem by measuring the free heap around
+ * the code allocating or freeing its resources (memstats_begin()/memstats_end()).
+ * Sections are tracked per task and can be nested, the inner subsystem usage is
+ * then not attributed to the outer one. A subsystem with a non zero balance
+ * once stopped and deinitialized is leaking.
+ *
+ * The measurement is global to the heap, allocations made by other tasks in the
+ * meantime (e.g. Wi-Fi, or another task's section) are attributed to the
+ * current subsystem too: the balances are approximate.
+ */
+enum mem_subsys
+{
+    MEM_UDP,
+    MEM_RTP,
+    MEM_PLAYER,
+    MEM_RECORDER,
+    MEM_SUBSYS_COUNT,
+};
+
+void memstats_begin(enum mem_subsys subsys);
+void memstats_end(void);
+int32_t memstats_balance(enum mem_subsys subsys);
+
+/*
+ * Stack high-water marks of the audio tasks.
+ *
+ * Tasks are registered when created and unregistered right before being
+ * deleted, so that their lowest free stack is kept after they are gone.
+ * Their stack and TCB are not part of the subsystems heap usage.
+ */
+void memstats_task_add(TaskHandle_t handle, uint32_t stack_size);
+void memstats_task_remove(TaskHandle_t handle);
+
+void memstats_log(void);
@@ -0,0 +1,85 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "meter.h"
+
+#include <math.h>
+#include <string.h>
+#include <sdkconfig.h>
+#include <esp_log.h>
+
+static const char *TAG = "meter";
+
+#define SILENCE 128
+
+void meter_init(meter_t *meter)
+{
+    memset(meter, 0, sizeof(*meter));
+    meter->window = ((uint64_t)CONFIG_AUDIO_SAMPLE_RATE * CONFIG_AUDIO_METER_WINDOW_MS) / 1000;
+}
+
+/*
+ * Runs on every audio block, so it keeps to one multiplication and no branch
+ * per sample. The sum of squares of a block cannot overflow 32 bits below
+ * 2^32 / 128^2 = 262144 samples.
+ */
+void meter_block(meter_t *meter, const uint8_t *restrict samples, size_t length)
+{
+    uint32_t sum_sq = 0;
+    uint32_t peak = meter->peak;
+    uint32_t clips = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        int32_t d = samples[i] - SILENCE;
+        uint32_t a = d < 0 ? -d : d;
+
+        sum_sq += a * a;
+        peak = a > peak ? a : peak;
+        // 0 and 255 both wrap to below 2
+        clips += (uint8_t)(samples[i] + 1) < 2;
+    }
+
+    meter->sum_sq += sum_sq;
+    meter->peak = peak;
+    meter->clips += clips;
+    meter->samples += length;
+
+    if (meter->samples < meter->window)
+        return;
+
+    meter->last_peak = meter->peak;
+    meter->last_rms = sqrtf((float)meter->sum_sq / meter->samples);
+    meter->last_clips = meter->clips;
+    meter->windows++;
+
+    if (meter->peak > meter->max_peak)
+        meter->max_peak = meter->peak;
+    meter->total_clips += meter->clips;
+
+    meter->samples = 0;
+    meter->sum_sq = 0;
+    meter->peak = 0;
+    meter->clips = 0;
+}
+
+static float dbfs(uint8_t level)
+{
+    return level ? 20.0f * log10f(level / (float)SILENCE) : -INFINITY;
+}
+
+void meter_log(meter_t *meter, const char *name)
+{
+    if (meter->windows == 0)
+    {
+        ESP_LOGI(TAG, "%s level: no complete %d ms window yet", name, CONFIG_AUDIO_METER_WINDOW_MS);
+        return;
+    }
+
+    ESP_LOGI(TAG, "%s level over %d ms: peak %.1f dBFS, RMS %.1f dBFS, clipped: %" PRIu32 " samples. Max peak %.1f dBFS, clipped: %" PRIu32 " samples",
+             name, CONFIG_AUDIO_METER_WINDOW_MS, dbfs(meter->last_peak), dbfs(meter->last_rms), meter->last_clips,
+             dbfs(meter->max_peak), meter->total_clips);
+}
@@ -0,0 +1,41 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Audio level meter for 8 bit unsigned samples.
+ *
+ * Peak, RMS and clipped samples are accumulated over the blocks of samples
+ * going through a stream and reported for the last complete window of
+ * CONFIG_AUDIO_METER_WINDOW_MS. A window ends with the block that completes
+ * it. Levels are amplitudes from 0 to 128 (full scale).
+ */
+typedef struct meter
+{
+    uint32_t window;    // Window length, in samples
+    uint32_t samples;   // Samples in the current window
+    uint64_t sum_sq;
+    uint8_t peak;
+    uint32_t clips;
+
+    // Last complete window
+    uint32_t windows;
+    uint8_t last_peak;
+    uint8_t last_rms;
+    uint32_t last_clips;
+
+    // Since the start
+    uint8_t max_peak;
+    uint32_t total_clips;
+} meter_t;
+
+void meter_init(meter_t *meter);
+void meter_block(meter_t *meter, const uint8_t *samples, size_t length);
+void meter_log(meter_t *meter, const char *name);
@@ -0,0 +1,42 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "mixer.h"
+
+#include <string.h>
+
+static inline uint8_t clip(int32_t v)
+{
+    if (v < -MIXER_SILENCE)
+        v = -MIXER_SILENCE;
+    else if (v > MIXER_SILENCE - 1)
+        v = MIXER_SILENCE - 1;
+
+    return v + MIXER_SILENCE;
+}
+
+void mixer_clear(int16_t *acc, size_t length)
+{
+    memset(acc, 0, length * sizeof(*acc));
+}
+
+void mixer_add(int16_t *restrict acc, const uint8_t *restrict in, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        acc[i] += in[i] - MIXER_SILENCE;
+}
+
+void mixer_output(const int16_t *restrict acc, size_t length, uint8_t *restrict out)
+{
+    for (size_t i = 0; i < length; i++)
+        out[i] = clip(acc[i]);
+}
+
+void mixer_overlay(uint8_t *restrict out, const uint8_t *restrict in, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        out[i] = clip(out[i] + in[i] - 2 * MIXER_SILENCE);
+}
@@ -0,0 +1,24 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Saturating mixer for 8 bit unsigned samples (L8, silence at 128).
+ *
+ * Sources are summed as signed values in a 16 bit accumulator, which cannot
+ * overflow for up to 256 sources, and clipped once when converting back.
+ */
+#define MIXER_SILENCE 128
+
+void mixer_clear(int16_t *acc, size_t length);
+void mixer_add(int16_t *acc, const uint8_t *in, size_t length);
+void mixer_output(const int16_t *acc, size_t length, uint8_t *out);
+// Mix in into out, in place, for a single extra source
+void mixer_overlay(uint8_t *out, const uint8_t *in, size_t length);
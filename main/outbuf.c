@@ -0,0 +1,119 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "outbuf.h"
+
+#include <string.h>
+
+#define SILENCE 128
+// Samples to go from the last played sample to silence, avoiding a click
+#define SILENCE_RAMP 32
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+void outbuf_init(outbuf_t *ob, size_t prefill)
+{
+    memset(ob, 0, sizeof(*ob));
+    ob->prefill = MIN(prefill, OUTBUF_LEN);
+    ob->priming = true;
+    ob->last = SILENCE;
+    ob->level_min = OUTBUF_LEN;
+}
+
+size_t outbuf_space(outbuf_t *ob)
+{
+    return OUTBUF_LEN - ob->fill;
+}
+
+// Returns the number of samples stored, the others are dropped and counted as overruns
+size_t outbuf_write(outbuf_t *ob, const uint8_t *data, size_t length)
+{
+    size_t len = MIN(length, outbuf_space(ob));
+
+    ob->overruns += length - len;
+
+    for (size_t done = 0; done < len;)
+    {
+        size_t pos = (ob->read + ob->fill) % OUTBUF_LEN;
+        size_t n = MIN(len - done, OUTBUF_LEN - pos);
+
+        memcpy(ob->data + pos, data + done, n);
+        ob->fill += n;
+        done += n;
+    }
+
+    return len;
+}
+
+static void fill_silence(outbuf_t *ob, uint8_t *out, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (ob->last != SILENCE && i < SILENCE_RAMP)
+            out[i] = ob->last + ((SILENCE - ob->last) * (int)(i + 1)) / SILENCE_RAMP;
+        else
+            out[i] = SILENCE;
+    }
+
+    if (length > 0)
+        ob->last = out[length - 1];
+    ob->silence += length;
+}
+
+/*
+ * Always writes length samples to out, completed with silence when there is
+ * not enough audio. Returns the number of audio samples.
+ */
+size_t outbuf_read(outbuf_t *ob, uint8_t *out, size_t length)
+{
+    if (ob->priming)
+    {
+        if (ob->fill < ob->prefill || ob->fill < length)
+        {
+            fill_silence(ob, out, length);
+            if (ob->underruns > 0)
+                ob->gap += length;
+            return 0;
+        }
+
+        // Only a gap heard between audio samples, not the end of the stream
+        ob->priming = false;
+        ob->gaps += ob->gap;
+        ob->gap = 0;
+    }
+
+    if (ob->fill < ob->level_min)
+        ob->level_min = ob->fill;
+    if (ob->fill > ob->level_max)
+        ob->level_max = ob->fill;
+
+    size_t len = MIN(length, ob->fill);
+
+    for (size_t done = 0; done < len;)
+    {
+        size_t n = MIN(len - done, OUTBUF_LEN - ob->read);
+
+        memcpy(out + done, ob->data + ob->read, n);
+        ob->read = (ob->read + n) % OUTBUF_LEN;
+        ob->fill -= n;
+        done += n;
+    }
+
+    if (len > 0)
+        ob->last = out[len - 1];
+    ob->played += len;
+
+    if (len < length)
+    {
+        // Ran dry: wait for the buffer to be refilled before playing again
+        ob->underruns++;
+        ob->priming = true;
+        ob->gap = length - len;
+        fill_silence(ob, out + len, length - len);
+    }
+
+    return len;
+}
@@ -0,0 +1,54 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sdkconfig.h>
+
+/*
+ * Samples waiting to be loaded into the DAC DMA buffers.
+ *
+ * The DMA buffers are refilled whenever the DAC is done with one, whether
+ * audio arrived or not: the buffer is then completed with silence instead of
+ * replaying its stale contents. After running dry, audio is only played
+ * again once `prefill` samples are buffered, so that a late stream is not
+ * chopped into short bursts.
+ *
+ * This has no dependency on the DAC driver, the refill pace is only given by
+ * the outbuf_read calls.
+ */
+#if CONFIG_AUDIO_SYNC
+// The packets wait here for their playout time, up to CONFIG_AUDIO_SYNC_DELAY_MS
+#define OUTBUF_LEN 8192
+#else
+#define OUTBUF_LEN 4096
+#endif
+
+typedef struct outbuf
+{
+    uint8_t data[OUTBUF_LEN];
+    size_t read;
+    size_t fill;
+    size_t prefill;
+    bool priming;   // Waiting for prefill samples before playing
+    uint8_t last;   // Last sample played, silence ramps from it
+    uint32_t underruns; // Refills that ran out of audio
+    uint32_t overruns;  // Samples dropped because the buffer was full
+    uint32_t silence;   // Samples of silence inserted
+    uint64_t played;    // Audio samples played
+    uint64_t gaps;      // Silence samples between audio samples: an underrun until the audio resumed
+    uint64_t gap;       // Silence samples since the last underrun, counted in gaps once the audio resumes
+    size_t level_min;   // Fill level at refill time, once playing
+    size_t level_max;
+} outbuf_t;
+
+void outbuf_init(outbuf_t *ob, size_t prefill);
+size_t outbuf_space(outbuf_t *ob);
+size_t outbuf_write(outbuf_t *ob, const uint8_t *data, size_t length);
+size_t outbuf_read(outbuf_t *ob, uint8_t *out, size_t length);
@@ -0,0 +1,74 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "payload.h"
+
+// From the best quality to the lowest bandwidth
+static const payload_format_t formats[PAYLOAD_FORMAT_COUNT] = {
+    {.pt = PAYLOAD_PT_L8, .decimation = 1},
+    {.pt = 97, .decimation = 2},
+    {.pt = 98, .decimation = 4},
+};
+
+const payload_format_t *payload_format(unsigned int level)
+{
+    if (level >= PAYLOAD_FORMAT_COUNT)
+        level = PAYLOAD_FORMAT_COUNT - 1;
+
+    return &formats[level];
+}
+
+const payload_format_t *payload_format_by_pt(uint8_t pt)
+{
+    for (int i = 0; i < PAYLOAD_FORMAT_COUNT; i++)
+    {
+        if (formats[i].pt == pt)
+            return &formats[i];
+    }
+
+    return &formats[0];
+}
+
+// Average groups of factor samples, which also filters out what the lower rate cannot carry
+size_t payload_decimate(const uint8_t *in, size_t length, uint8_t factor, uint8_t *out)
+{
+    size_t out_len = length / factor;
+
+    for (size_t i = 0; i < out_len; i++)
+    {
+        uint32_t sum = 0;
+
+        for (int k = 0; k < factor; k++)
+            sum += in[i * factor + k];
+
+        out[i] = sum / factor;
+    }
+
+    return out_len;
+}
+
+/*
+ * Linear interpolation from the previous sample (kept in prev across packets)
+ * to each input sample. out must hold length * factor samples.
+ */
+size_t payload_upsample(const uint8_t *in, size_t length, uint8_t factor, uint8_t *prev, uint8_t *out)
+{
+    int32_t a = *prev;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        int32_t b = in[i];
+
+        for (int k = 1; k <= factor; k++)
+            *out++ = a + ((b - a) * k) / factor;
+
+        a = b;
+    }
+
+    *prev = a;
+
+    return length * factor;
+}
@@ -0,0 +1,48 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Payload formats of the audio stream.
+ *
+ * All formats are 8 bit unsigned mono samples (L8). The reduced rate formats
+ * carry CONFIG_AUDIO_SAMPLE_RATE / decimation samples per second, signalled by
+ * their payload type so that the sender can switch in the middle of a stream.
+ * The RTP timestamps always run at CONFIG_AUDIO_SAMPLE_RATE.
+ *
+ * Unknown payload types are played as full rate L8, like before formats were
+ * signalled.
+ */
+#define PAYLOAD_PT_L8 96
+/*
+ * Comfort noise (RFC 3389), sent during silence with CONFIG_AUDIO_VAD. The
+ * static payload type 13 is for an 8 kHz clock, this one counts timestamps at
+ * CONFIG_AUDIO_SAMPLE_RATE like the audio.
+ */
+#define PAYLOAD_PT_CN 99
+/*
+ * FEC parity packets (see fec.h). They are never played, even by a receiver
+ * built without CONFIG_AUDIO_RTP_FEC.
+ */
+#define PAYLOAD_PT_FEC 127
+
+typedef struct payload_format
+{
+    uint8_t pt;
+    uint8_t decimation;
+} payload_format_t;
+
+#define PAYLOAD_FORMAT_COUNT 3
+#define PAYLOAD_MAX_DECIMATION 4
+
+const payload_format_t *payload_format(unsigned int level);
+const payload_format_t *payload_format_by_pt(uint8_t pt);
+size_t payload_decimate(const uint8_t *in, size_t length, uint8_t factor, uint8_t *out);
+size_t payload_upsample(const uint8_t *in, size_t length, uint8_t factor, uint8_t *prev, uint8_t *out);
@@ -0,0 +1,151 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "plc.h"
+
+#include <string.h>
+#include <sdkconfig.h>
+
+#define SILENCE 128
+
+// Voice pitch from 66 to 400 Hz
+#define MIN_PERIOD (CONFIG_AUDIO_SAMPLE_RATE / 400)
+#define MAX_PERIOD (CONFIG_AUDIO_SAMPLE_RATE / 66)
+// Samples compared for each candidate period
+#define WINDOW (CONFIG_AUDIO_SAMPLE_RATE / 200)
+#define FADE_START (CONFIG_AUDIO_SAMPLE_RATE / 100)
+#define FADE_END (CONFIG_AUDIO_SAMPLE_RATE * 6 / 100)
+#define MERGE_LEN (CONFIG_AUDIO_SAMPLE_RATE / 1000)
+
+_Static_assert(MAX_PERIOD + WINDOW <= PLC_HISTORY, "The PLC history is too short for the pitch search");
+
+void plc_init(plc_t *plc)
+{
+    memset(plc, 0, sizeof(*plc));
+    memset(plc->history, SILENCE, sizeof(plc->history));
+}
+
+// Correlation of the last WINDOW samples with the ones lag earlier, normalized by the energy of the latter
+static int64_t score(const uint8_t *end, int lag, int step)
+{
+    int32_t corr = 0;
+    int32_t energy = 1;
+
+    for (int i = 1; i <= WINDOW; i += step)
+    {
+        int32_t a = (int32_t)end[-i] - SILENCE;
+        int32_t b = (int32_t)end[-i - lag] - SILENCE;
+
+        corr += a * b;
+        energy += b * b;
+    }
+
+    return ((int64_t)corr * (corr < 0 ? -corr : corr)) / energy;
+}
+
+static uint16_t find_period(plc_t *plc)
+{
+    const uint8_t *end = plc->history + PLC_HISTORY;
+    int64_t best_score = INT64_MIN;
+    int best = MIN_PERIOD;
+
+    // Coarse search on every other sample and lag, then refine around the best lag
+    for (int lag = MIN_PERIOD; lag <= MAX_PERIOD; lag += 2)
+    {
+        int64_t s = score(end, lag, 2);
+        if (s > best_score)
+        {
+            best_score = s;
+            best = lag;
+        }
+    }
+
+    // A multiple of the period matches as well as the period itself, prefer the period
+    for (int div = 3; div >= 2; div--)
+    {
+        int lag = best / div;
+
+        if (lag >= MIN_PERIOD && score(end, lag, 2) >= best_score - best_score / 8)
+        {
+            best = lag;
+            break;
+        }
+    }
+
+    int coarse = best;
+    best_score = INT64_MIN;
+    for (int lag = coarse - 1; lag <= coarse + 1; lag++)
+    {
+        if (lag < MIN_PERIOD || lag > MAX_PERIOD)
+            continue;
+
+        int64_t s = score(end, lag, 1);
+        if (s > best_score)
+        {
+            best_score = s;
+            best = lag;
+        }
+    }
+
+    return best;
+}
+
+// Next sample of the repetition, with its fade out
+static uint8_t synthesize(plc_t *plc)
+{
+    uint32_t pos = plc->position++;
+
+    if (pos >= FADE_END)
+        return SILENCE;
+
+    int32_t s = (int32_t)plc->history[PLC_HISTORY - plc->period + pos % plc->period] - SILENCE;
+
+    if (pos > FADE_START)
+        s = (s * (int32_t)(FADE_END - pos)) / (FADE_END - FADE_START);
+
+    return SILENCE + s;
+}
+
+// Record received samples, cross-fading their start with the repetition after a loss
+void plc_received(plc_t *plc, uint8_t *samples, size_t length)
+{
+    if (plc->concealing)
+    {
+        for (size_t i = 0; i < length && i < MERGE_LEN; i++)
+        {
+            int32_t synth = synthesize(plc);
+
+            samples[i] = (samples[i] * (int32_t)i + synth * (int32_t)(MERGE_LEN - i)) / MERGE_LEN;
+        }
+        plc->concealing = false;
+    }
+
+    if (length >= PLC_HISTORY)
+    {
+        memcpy(plc->history, samples + length - PLC_HISTORY, PLC_HISTORY);
+    }
+    else
+    {
+        memmove(plc->history, plc->history + length, PLC_HISTORY - length);
+        memcpy(plc->history + PLC_HISTORY - length, samples, length);
+    }
+}
+
+// Fill in for missing samples, consecutive calls continue the same repetition
+void plc_conceal(plc_t *plc, uint8_t *samples, size_t length)
+{
+    if (!plc->concealing)
+    {
+        plc->concealing = true;
+        plc->period = find_period(plc);
+        plc->position = 0;
+    }
+
+    for (size_t i = 0; i < length; i++)
+        samples[i] = synthesize(plc);
+
+    plc->samples += length;
+}
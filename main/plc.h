@@ -0,0 +1,40 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Packet loss concealment for 8 bit unsigned samples at the DAC rate.
+ *
+ * The last PLC_HISTORY played samples are kept. When a packet is missing,
+ * its samples are replaced by repeating the last pitch period of the history,
+ * found by autocorrelation once per loss. The repetition plays at full level
+ * for 10 ms, then fades out to silence at 60 ms. The first samples of the
+ * next packet are cross-faded with the repetition, so that there is no step
+ * at either end of the gap.
+ *
+ * The pitch search is the only costly part. It is bounded by working on every
+ * other sample and lag before refining around the best lag.
+ */
+#define PLC_HISTORY 1024
+
+typedef struct plc
+{
+    uint8_t history[PLC_HISTORY]; // Oldest first
+    size_t packet_len;  // Samples in the last received packet, the length of a missing one
+    bool concealing;
+    uint16_t period;    // Pitch period repeated during the current loss
+    uint32_t position;  // Samples concealed since the start of the loss
+    uint32_t samples;   // Samples concealed in total
+} plc_t;
+
+void plc_init(plc_t *plc);
+void plc_received(plc_t *plc, uint8_t *samples, size_t length);
+void plc_conceal(plc_t *plc, uint8_t *samples, size_t length);
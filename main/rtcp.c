@@ -0,0 +1,133 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "rtcp.h"
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+struct rtcp_header
+{
+    uint8_t flags; // version (2 bits), padding (1 bit), report count (5 bits)
+    uint8_t pt;
+    uint16_t length; // In 32 bit words, minus one
+    uint32_t ssrc;
+};
+
+struct rtcp_report_block
+{
+    uint32_t ssrc;
+    uint32_t lost; // fraction lost (8 bits), cumulative lost (24 bits)
+    uint32_t highest_seq;
+    uint32_t jitter;
+    uint32_t lsr;
+    uint32_t dlsr;
+};
+
+struct rtcp_sender_block
+{
+    uint32_t ntp_sec;
+    uint32_t ntp_frac;
+    uint32_t rtp_ts;
+    uint32_t packets;
+    uint32_t octets;
+};
+
+_Static_assert(sizeof(struct rtcp_header) + sizeof(struct rtcp_report_block) == RTCP_RR_LEN, "Wrong RTCP RR size");
+_Static_assert(sizeof(struct rtcp_header) + sizeof(struct rtcp_sender_block) == RTCP_SR_LEN, "Wrong RTCP SR size");
+
+/*
+ * Whether a datagram received on the RTP port is RTCP (RFC 5761 4): the
+ * RTCP packet types fall on RTP payload types 64 to 95 with the marker set,
+ * which are not used by RTP.
+ */
+bool rtcp_is_rtcp(const uint8_t *buf, size_t length)
+{
+    return length >= sizeof(struct rtcp_header) && (buf[0] >> 6) == 2 && buf[1] >= 192 && buf[1] <= 223;
+}
+
+size_t rtcp_build_rr(uint8_t *buf, uint32_t ssrc, const rtcp_report_t *report)
+{
+    struct rtcp_header *hdr = (struct rtcp_header *)buf;
+    struct rtcp_report_block *block = (struct rtcp_report_block *)(buf + sizeof(*hdr));
+
+    hdr->flags = (2 << 6) | 1;
+    hdr->pt = RTCP_PT_RR;
+    hdr->length = htons(RTCP_RR_LEN / 4 - 1);
+    hdr->ssrc = htonl(ssrc);
+
+    block->ssrc = htonl(report->ssrc);
+    block->lost = htonl(((uint32_t)report->fraction_lost << 24) | (report->cumulative_lost & 0xffffff));
+    block->highest_seq = htonl(report->highest_seq);
+    block->jitter = htonl(report->jitter);
+    block->lsr = htonl(report->lsr);
+    block->dlsr = htonl(report->dlsr);
+
+    return RTCP_RR_LEN;
+}
+
+// Parse the first report block of a receiver report
+int rtcp_parse_rr(const uint8_t *buf, size_t length, rtcp_report_t *report)
+{
+    const struct rtcp_header *hdr = (const struct rtcp_header *)buf;
+    const struct rtcp_report_block *block = (const struct rtcp_report_block *)(buf + sizeof(*hdr));
+
+    if (length < RTCP_RR_LEN || (hdr->flags >> 6) != 2 || hdr->pt != RTCP_PT_RR || (hdr->flags & 0x1f) == 0)
+        return -EINVAL;
+
+    uint32_t lost = ntohl(block->lost);
+
+    report->ssrc = ntohl(block->ssrc);
+    report->fraction_lost = lost >> 24;
+    // Sign extend the 24 bits cumulative count
+    report->cumulative_lost = (int32_t)(lost << 8) >> 8;
+    report->highest_seq = ntohl(block->highest_seq);
+    report->jitter = ntohl(block->jitter);
+    report->lsr = ntohl(block->lsr);
+    report->dlsr = ntohl(block->dlsr);
+
+    return 0;
+}
+
+// A sender report without report blocks
+size_t rtcp_build_sr(uint8_t *buf, uint32_t ssrc, const rtcp_sender_info_t *info)
+{
+    struct rtcp_header *hdr = (struct rtcp_header *)buf;
+    struct rtcp_sender_block *block = (struct rtcp_sender_block *)(buf + sizeof(*hdr));
+
+    hdr->flags = 2 << 6;
+    hdr->pt = RTCP_PT_SR;
+    hdr->length = htons(RTCP_SR_LEN / 4 - 1);
+    hdr->ssrc = htonl(ssrc);
+
+    block->ntp_sec = htonl(info->ntp_sec);
+    block->ntp_frac = htonl(info->ntp_frac);
+    block->rtp_ts = htonl(info->rtp_ts);
+    block->packets = htonl(info->packets);
+    block->octets = htonl(info->octets);
+
+    return RTCP_SR_LEN;
+}
+
+// Parse the sender info of a sender report, its report blocks are ignored
+int rtcp_parse_sr(const uint8_t *buf, size_t length, uint32_t *ssrc, rtcp_sender_info_t *info)
+{
+    const struct rtcp_header *hdr = (const struct rtcp_header *)buf;
+    const struct rtcp_sender_block *block = (const struct rtcp_sender_block *)(buf + sizeof(*hdr));
+
+    if (length < RTCP_SR_LEN || (hdr->flags >> 6) != 2 || hdr->pt != RTCP_PT_SR)
+        return -EINVAL;
+
+    *ssrc = ntohl(hdr->ssrc);
+    info->ntp_sec = ntohl(block->ntp_sec);
+    info->ntp_frac = ntohl(block->ntp_frac);
+    info->rtp_ts = ntohl(block->rtp_ts);
+    info->packets = ntohl(block->packets);
+    info->octets = ntohl(block->octets);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Minimal RTCP support (RFC 3550). Reports are sent on the RTP port + 1,
+ * sender reports on the RTP port itself with CONFIG_AUDIO_SYNC_RTCP_MUX
+ * (RFC 5761).
+ */
+#define RTCP_PT_SR 200
+#define RTCP_PT_RR 201
+
+#define RTCP_RR_LEN 32
+#define RTCP_SR_LEN 28
+
+typedef struct rtcp_report
+{
+    uint32_t ssrc;          // Source this report is about
+    uint8_t fraction_lost;  // Since the previous report, in 1/256
+    int32_t cumulative_lost;
+    uint32_t highest_seq;   // Extended highest sequence number received
+    uint32_t jitter;        // Interarrival jitter, in timestamp units
+    uint32_t lsr;
+    uint32_t dlsr;
+} rtcp_report_t;
+
+typedef struct rtcp_sender_info
+{
+    uint32_t ntp_sec;   // Wallclock when the report was sent, in NTP format
+    uint32_t ntp_frac;
+    uint32_t rtp_ts;    // RTP timestamp of the stream at that time
+    uint32_t packets;   // Sent since the start
+    uint32_t octets;    // Payload bytes sent since the start
+} rtcp_sender_info_t;
+
+bool rtcp_is_rtcp(const uint8_t *buf, size_t length);
+size_t rtcp_build_rr(uint8_t *buf, uint32_t ssrc, const rtcp_report_t *report);
+int rtcp_parse_rr(const uint8_t *buf, size_t length, rtcp_report_t *report);
+size_t rtcp_build_sr(uint8_t *buf, uint32_t ssrc, const rtcp_sender_info_t *info);
+int rtcp_parse_sr(const uint8_t *buf, size_t length, uint32_t *ssrc, rtcp_sender_info_t *info);
@@ -5,93 +5,249 @@
  */
 
 #include "rtp.h"
+#include "memstats.h"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
 #include <stdio.h>
+#include <sys/param.h>
 #include <arpa/inet.h>
 
 static const char *TAG = "rtp";
 
-#define RTP_HEADER_LEN 12
+#define MAX_PACKET_LEN RTP_MAX_PACKET_LEN
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-struct rtp_header
-{
-    uint8_t cc : 4;
-    uint8_t extension : 1;
-    uint8_t padding : 1;
-    uint8_t version : 2;
-    uint8_t pt : 7;
-    uint8_t mark : 1;
-    uint16_t sequence_number;
-    uint32_t ts;
-    uint32_t ssrc;
-};
+// One packet every ptime, carrying exactly ptime worth of samples
+#define SEND_PAYLOAD_LEN ((CONFIG_AUDIO_SAMPLE_RATE * CONFIG_AUDIO_RTP_PTIME_MS) / 1000)
+#define SEND_PERIOD_US (((uint64_t)SEND_PAYLOAD_LEN * 1000000) / CONFIG_AUDIO_SAMPLE_RATE)
+// The samples are captured right after the room left for the header
+#define SEND_PACKET_LEN (RTP_HEADER_LEN + SEND_PAYLOAD_LEN)
+#if CONFIG_AUDIO_RTP_ADAPT
+// Room after the captured samples for those a decimated packet left over, see decimate_payload()
+#define SEND_CARRY_MAX (PAYLOAD_MAX_DECIMATION - 1)
 #else
-struct rtp_header
-{
-    uint8_t version : 2;
-    uint8_t padding : 1;
-    uint8_t extension : 1;
-    uint8_t cc : 4;
-    uint8_t mark : 1;
-    uint8_t pt : 7;
-    uint16_t sequence_number;
-    uint32_t ts;
-    uint32_t ssrc;
-};
+#define SEND_CARRY_MAX 0
+#endif
+#define SEND_SLOT_LEN (SEND_PACKET_LEN + SEND_CARRY_MAX)
+#if CONFIG_AUDIO_SINGLE_TASK
+#define SEND_PACKETS 1
+#else
+// Queued packets + the one over the limit until the next send slot + the one being captured + the one being sent
+#define SEND_PACKETS (CONFIG_AUDIO_RTP_SEND_QUEUE_PACKETS + 3)
+#endif
+
+_Static_assert(SEND_SLOT_LEN <= MAX_PACKET_LEN, "A packet of CONFIG_AUDIO_RTP_PTIME_MS does not fit in RTP_MAX_PACKET_LEN");
+#if CONFIG_AUDIO_RTP_FEC
+_Static_assert(SEND_SLOT_LEN + FEC_HEADER_LEN <= MAX_PACKET_LEN, "The FEC parity of a packet of CONFIG_AUDIO_RTP_PTIME_MS does not fit in RTP_MAX_PACKET_LEN");
+#endif
+
+#define RECV_QUEUE_LEN CONFIG_AUDIO_RTP_RECV_BURST_PACKETS
+#if CONFIG_AUDIO_NET_IMPAIR
+#define RECV_HELD_BUFFERS 1
+#else
+#define RECV_HELD_BUFFERS 0
+#endif
+#if CONFIG_AUDIO_RTP_FEC && FEC_GROUP > CONFIG_AUDIO_RTP_REORDER_DEPTH
+// Wait for the parity of the group before giving up on a packet
+#define RECV_REORDER_DEPTH FEC_GROUP
+#else
+#define RECV_REORDER_DEPTH CONFIG_AUDIO_RTP_REORDER_DEPTH
+#endif
+// Queued packets + the one being played + the one being received + the ones waiting
+// for a missing packet in the reorder window of each source + a recovered one
+#define RECV_BUF_COUNT (RECV_QUEUE_LEN + 2 + RECV_HELD_BUFFERS + RTP_MAX_SOURCES * RECV_REORDER_DEPTH + 1)
+#define RECV_TIMEOUT (20 / portTICK_PERIOD_MS)
+
+// A source slot can be taken over by a new SSRC once silent for this long
+#define SOURCE_TIMEOUT_US 1000000
+// Sequence number jumps followed right away, further ones need a confirmation (RFC 3550 A.1)
+#define RTP_SEQ_MOD (1 << 16)
+#define MAX_DROPOUT 3000
+#define MAX_MISORDER 100
+#define RTCP_MAX_LEN 128
+#if CONFIG_AUDIO_SYNC && !CONFIG_AUDIO_SYNC_RTCP_MUX
+// The sender reports go to the RTCP port, RTP port + 1
+#define SYNC_RTCP_PORT 1
+#else
+#define SYNC_RTCP_PORT 0
 #endif
+// Receiver reports waiting for the stream sent through a shared RTCP socket, see rtp_share_socket
+#define SHARED_REPORTS 4
+#define RTCP_INTERVAL_US (CONFIG_AUDIO_RTCP_INTERVAL_MS * 1000)
+#define SYNC_DELAY_US (CONFIG_AUDIO_SYNC_DELAY_MS * 1000)
+// Comfort noise level updates during silence
+#define CN_INTERVAL_PACKETS (500 / CONFIG_AUDIO_RTP_PTIME_MS)
 
-const int BUF_COUNT = 5;
-const int BUF_SIZE = 1400;
+// Stack depths are in bytes. The packets are sent from the send pool, only a parity packet is built on the stack.
+#define RECV_TASK_STACK 4096
+#define SEND_TASK_STACK (4096 + RTP_SEND_STACK)
 
-struct rtp_packet
+struct rtp_buffer
 {
+    int64_t recv_time;
+    uint8_t source; // Index in rtp->sources
+    struct in_addr from;
     size_t len;
-    uint8_t *data;
+#if CONFIG_AUDIO_SYNC
+    int64_t play_time; // Wallclock time of its first sample, 0 when unknown
+#endif
+    uint8_t data[MAX_PACKET_LEN];
 };
 
 void rtp_init(rtp_t *rtp, uint16_t port, enum rtp_direction direction)
 {
-    rtp->first_packet = 1;
+    memstats_begin(MEM_RTP);
+
+    // Random, so that units restarting or sending to the same receivers do not collide (RFC 3550 8.1)
+    rtp->ssrc = esp_random();
     rtp->last_seq = 0;
     rtp->sent_bytes = 0;
+    rtp->last_report_time = 0;
+    rtp->rtcp.sock = -1;
+    rtp->shared_socket = false;
+#if CONFIG_AUDIO_RTP_ADAPT
+    rtp->reports = NULL;
+#endif
     rtp->direction = direction;
+    memset(&rtp->stats, 0, sizeof(rtp->stats));
+    // Packets are late once the next one is due
+    sched_latency_init(&rtp->latency, SEND_PERIOD_US);
 
     audio_udp_init(&rtp->udp, port);
 
     if (direction == RTP_RECV)
     {
-        rtp->queue = xQueueCreate(5, sizeof(struct rtp_packet)); // TODO: Port to using a bytebuf ringbuffer
+        // All the buffers, plus the stop request, always fit in the queues
+        rtp->pool = malloc(RECV_BUF_COUNT * sizeof(struct rtp_buffer));
+        rtp->free_queue = xQueueCreate(RECV_BUF_COUNT, sizeof(struct rtp_buffer *));
+        rtp->queue = xQueueCreate(RECV_BUF_COUNT + 1, sizeof(struct rtp_buffer *));
+        assert(rtp->pool && rtp->free_queue && rtp->queue);
+
+        for (int i = 0; i < RECV_BUF_COUNT; i++)
+        {
+            struct rtp_buffer *b = &rtp->pool[i];
+            xQueueSend(rtp->free_queue, &b, 0);
+        }
+        rtp->current = NULL;
+
+        for (int i = 0; i < RTP_MAX_SOURCES; i++)
+            rtp->sources[i].active = false;
+
         audio_udp_bind(&rtp->udp);
+        udp_set_recv_buffer(&rtp->udp, RECV_QUEUE_LEN * MAX_PACKET_LEN);
+#if defined(CONFIG_LWIP_UDP_RECVMBOX_SIZE) && CONFIG_LWIP_UDP_RECVMBOX_SIZE < CONFIG_AUDIO_RTP_RECV_BURST_PACKETS
+        ESP_LOGW(TAG, "lwIP only queues %d datagrams per socket, bursts of %d packets will be cut",
+                 CONFIG_LWIP_UDP_RECVMBOX_SIZE, CONFIG_AUDIO_RTP_RECV_BURST_PACKETS);
+#endif
+        // Receiver reports go to the RTCP port of whoever sends the stream
+        audio_udp_init(&rtp->rtcp, port + 1);
+#if SYNC_RTCP_PORT
+        // And its sender reports come to ours
+        audio_udp_bind(&rtp->rtcp);
+#if CONFIG_AUDIO_RTP_ADAPT
+        rtp->reports = xQueueCreate(SHARED_REPORTS, sizeof(rtcp_report_t));
+        assert(rtp->reports);
+#endif
+#endif
+#if CONFIG_AUDIO_NET_IMPAIR
+        impair_init(&rtp->impair);
+        rtp->held = NULL;
+#if CONFIG_AUDIO_SINGLE_TASK
+        rtp->stall_end = 0;
+#endif
+#endif
     }
     else
     {
-        rtp->ring_buffer = xRingbufferCreate(BUF_COUNT * BUF_SIZE, RINGBUF_TYPE_BYTEBUF);
+        // Handed out to the capture by rtp_start
+        rtp->send_pool = malloc(SEND_PACKETS * SEND_SLOT_LEN);
+        assert(rtp->send_pool);
+#if !CONFIG_AUDIO_SINGLE_TASK
+        rtp->send_free = xQueueCreate(SEND_PACKETS, sizeof(uint8_t *));
+        rtp->send_queue = xQueueCreate(SEND_PACKETS, sizeof(uint8_t *));
+        assert(rtp->send_free && rtp->send_queue);
+#endif
+#if CONFIG_AUDIO_RTP_ADAPT || SYNC_RTCP_PORT
+        // Bound by rtp_start with CONFIG_AUDIO_RTP_ADAPT, for the receiver reports
+        audio_udp_init(&rtp->rtcp, port + 1);
+#endif
+#if CONFIG_AUDIO_RTP_ADAPT
+        adapt_init(&rtp->adapt);
+#endif
+#if CONFIG_AUDIO_RTP_FEC
+        // The parity packets are a stream of their own
+        fec_encoder_init(&rtp->fec_enc, esp_random());
+#endif
+#if CONFIG_AUDIO_VAD
+        vad_init(&rtp->vad);
+        rtp->cn_countdown = 0;
+#endif
     }
+
+    memstats_end();
+}
+
+/*
+ * Send through the bound socket of owner, a receiving stream on the same
+ * port, so that the peer sees a single address for both directions. rtp must
+ * be stopped before owner, which closes the socket.
+ *
+ * When both streams read the RTCP port, owner reads it for the two of them
+ * and queues the receiver reports of rtp in owner->reports.
+ */
+void rtp_share_socket(rtp_t *rtp, const rtp_t *owner)
+{
+    assert(rtp->direction == RTP_SEND && owner->direction == RTP_RECV);
+
+    udp_stop(&rtp->udp);
+    rtp->udp.sock = owner->udp.sock;
+    rtp->shared_socket = true;
+
+#if CONFIG_AUDIO_RTP_ADAPT && SYNC_RTCP_PORT
+    udp_stop(&rtp->rtcp);
+    rtp->rtcp.sock = owner->rtcp.sock;
+    rtp->reports = owner->reports;
+#endif
 }
 
 void rtp_deinit(rtp_t *rtp)
 {
+    memstats_begin(MEM_RTP);
+
     if (rtp->direction == RTP_RECV)
     {
         vQueueDelete(rtp->queue);
+        vQueueDelete(rtp->free_queue);
+        free(rtp->pool);
+#if CONFIG_AUDIO_RTP_ADAPT && SYNC_RTCP_PORT
+        vQueueDelete(rtp->reports);
+#endif
     }
     else
     {
-        vRingbufferDelete(rtp->ring_buffer);
+#if !CONFIG_AUDIO_SINGLE_TASK
+        vQueueDelete(rtp->send_queue);
+        vQueueDelete(rtp->send_free);
+#endif
+        free(rtp->send_pool);
     }
 
     // udp_deinit(&rtp->udp); // Check again later
+
+    memstats_end();
 }
 
-static int push_packet(rtp_t *rtp, uint8_t *data, size_t length)
+static void release_buffer(rtp_t *rtp, struct rtp_buffer *b)
 {
-    struct rtp_header *hdr = (struct rtp_header *)data;
-    int32_t seq_num;
+    xQueueSend(rtp->free_queue, &b, 0);
+}
 
+static int check_header(struct rtp_header *hdr)
+{
     if (hdr->version != 2)
     {
         ESP_LOGE(TAG, "Unsupported RTP version: %u ", hdr->version);
@@ -109,155 +265,1062 @@ static int push_packet(rtp_t *rtp, uint8_t *data, size_t length)
         ESP_LOGW(TAG, "Padding is not supported, expect artifacts in output");
     }
 
-    seq_num = (int32_t)ntohs(hdr->sequence_number);
+    return 0;
+}
+
+static void update_stats(rtp_t *rtp, rtp_source_t *src, struct rtp_header *hdr)
+{
+    int32_t seq_num = (int32_t)ntohs(hdr->sequence_number);
 
-    if (rtp->first_packet)
+    // Arrival time in timestamp units, see RFC 3550 A.8
+    int64_t arrival = (esp_timer_get_time() * CONFIG_AUDIO_SAMPLE_RATE) / 1000000;
+    int64_t transit = arrival - ntohl(hdr->ts);
+
+    if (src->packets > 0 && seq_num != src->last_seq)
     {
-        rtp->first_packet = 0;
+        int64_t d = transit - src->last_transit;
+        if (d < 0)
+            d = -d;
+        src->jitter += d - ((src->jitter + 8) >> 4);
     }
-    else if ((int32_t)seq_num - rtp->last_seq < 1)
+    src->last_transit = transit;
+
+    rtp->stats.packets++;
+
+    if (src->first_packet)
+    {
+        src->first_packet = 0;
+    }
+    else if ((int16_t)(seq_num - src->last_seq) < 0)
     {
         ESP_LOGW(TAG, "Packets are not in order");
+        rtp->stats.out_of_order++;
+        return;
     }
-    else if ((int32_t)seq_num - rtp->last_seq > 1)
+    else if (seq_num < src->last_seq)
     {
-        ESP_LOGW(TAG, "Dropped %ld rtp packets", (seq_num - rtp->last_seq) - 1);
+        src->seq_cycles++;
     }
 
-    rtp->last_seq = seq_num;
+    src->last_seq = seq_num;
 
     ESP_LOGD(TAG, "RTP Packet: v: %u p: %s e: %s seq: %ld", hdr->version, hdr->padding ? "true" : "false", hdr->extension ? "true" : "false", seq_num);
+}
 
-    // use a ringbuffer ?
-    struct rtp_packet p;
-    p.data = data + RTP_HEADER_LEN;
-    p.len = length - RTP_HEADER_LEN;
-    xQueueSend(rtp->queue, &p, portMAX_DELAY);
+#if CONFIG_AUDIO_RTP_FEC
+static void recover_packet(rtp_t *rtp, rtp_source_t *src, uint16_t seq)
+{
+    struct rtp_buffer *b;
 
-    return 0;
+    if (!fec_decoder_can_recover(&src->fec_dec, seq))
+        return;
+
+    if (xQueueReceive(rtp->free_queue, &b, 0) != pdPASS)
+        return;
+
+    b->len = fec_decoder_recover(&src->fec_dec, seq, b->data);
+    b->recv_time = esp_timer_get_time();
+    b->source = src - rtp->sources;
+
+    if (jbuf_insert(&src->jbuf, seq, b) != 0)
+    {
+        release_buffer(rtp, b);
+        return;
+    }
+
+    rtp->stats.recovered++;
+}
+#endif
+
+// Tell the player where a packet is missing, so that it can conceal it
+static void report_missing(rtp_t *rtp, rtp_source_t *src)
+{
+    struct rtp_buffer *b;
+
+    // Without a spare buffer, the gap is skipped
+    if (xQueueReceive(rtp->free_queue, &b, 0) != pdPASS)
+        return;
+
+    b->len = 0;
+    b->recv_time = esp_timer_get_time();
+    b->source = src - rtp->sources;
+    xQueueSend(rtp->queue, &b, portMAX_DELAY);
+}
+
+#if CONFIG_AUDIO_SYNC
+/*
+ * When the first sample of a packet is to be heard, on the wallclock: the
+ * time its timestamp was sent at, after the last sender report of its
+ * source, plus the playout delay. 0 before the first sender report.
+ */
+static int64_t packet_play_time(rtp_source_t *src, struct rtp_buffer *b)
+{
+    if (!src->synced || !sync_clock_set())
+        return 0;
+
+    int32_t offset = ntohl(((struct rtp_header *)b->data)->ts) - src->sr_ts;
+
+    return src->sr_wallclock + ((int64_t)offset * 1000000) / CONFIG_AUDIO_SAMPLE_RATE + SYNC_DELAY_US;
+}
+#endif
+
+// Hand the packets out of the reorder window of a source to the player
+static void deliver_packets(rtp_t *rtp, rtp_source_t *src, bool flush)
+{
+    enum jbuf_result res;
+    uint16_t seq;
+    void *item;
+
+    do
+    {
+#if CONFIG_AUDIO_RTP_FEC
+        if (jbuf_waiting(&src->jbuf, src->jbuf.head))
+            recover_packet(rtp, src, src->jbuf.head);
+#endif
+
+        res = jbuf_pop(&src->jbuf, flush, &seq, &item);
+        if (res == JBUF_MISSING)
+        {
+            ESP_LOGW(TAG, "Dropped rtp packet %u", seq);
+            rtp->stats.lost++;
+            src->lost++;
+            report_missing(rtp, src);
+        }
+        else if (res == JBUF_PACKET)
+        {
+#if CONFIG_AUDIO_SYNC
+            ((struct rtp_buffer *)item)->play_time = packet_play_time(src, item);
+#endif
+            xQueueSend(rtp->queue, &item, portMAX_DELAY);
+        }
+    } while (res != JBUF_NONE);
+}
+
+static void source_init(rtp_source_t *src, uint32_t ssrc)
+{
+    memset(src, 0, sizeof(*src));
+    src->active = true;
+    src->ssrc = ssrc;
+    src->first_packet = 1;
+    src->bad_seq = RTP_SEQ_MOD + 1;
+    jbuf_init(&src->jbuf, RECV_REORDER_DEPTH);
+#if CONFIG_AUDIO_RTP_FEC
+    fec_decoder_init(&src->fec_dec);
+#endif
 }
 
-#define MAX_PACKET_LEN 1400
-#define MIN(a, b) (a) < (b) ? (a) : (b)
+// The receive state of this SSRC, if it is a known source
+static rtp_source_t *lookup_source(rtp_t *rtp, uint32_t ssrc)
+{
+    for (int i = 0; i < RTP_MAX_SOURCES; i++)
+    {
+        if (rtp->sources[i].active && rtp->sources[i].ssrc == ssrc)
+            return &rtp->sources[i];
+    }
+
+    return NULL;
+}
 
-// TODO: May need restrict
-static void pack_rtp(rtp_t *rtp, uint8_t *bytes, size_t len, uint8_t *rtp_packet, size_t *consumed, size_t *packet_size)
+#if CONFIG_AUDIO_RTP_FEC
+// Add a parity packet to the FEC groups of the source it protects
+static void push_parity(rtp_t *rtp, struct rtp_buffer *b)
 {
-    *packet_size = MIN(MAX_PACKET_LEN, len + RTP_HEADER_LEN);
-    *consumed = *packet_size - RTP_HEADER_LEN;
+    rtp_source_t *src;
+    uint32_t ssrc;
+
+    if (fec_parity_media_ssrc(b->data, b->len, &ssrc) == 0 && (src = lookup_source(rtp, ssrc)) != NULL)
+    {
+        fec_decoder_add_parity(&src->fec_dec, b->data, b->len);
+        release_buffer(rtp, b);
+        deliver_packets(rtp, src, false);
+        return;
+    }
+
+    release_buffer(rtp, b);
+}
+#endif
+
+// Find the receive state of this SSRC, or take over a slot that is free or went silent
+static rtp_source_t *find_source(rtp_t *rtp, uint32_t ssrc, int64_t now)
+{
+    rtp_source_t *slot = NULL;
+
+    for (int i = 0; i < RTP_MAX_SOURCES; i++)
+    {
+        rtp_source_t *src = &rtp->sources[i];
+
+        if (src->active && src->ssrc == ssrc)
+        {
+            if (now - src->last_packet_time <= SOURCE_TIMEOUT_US)
+                return src;
+
+            // Back after a silence, most likely restarted: start over in the same slot
+            slot = src;
+            break;
+        }
+
+        if (slot == NULL && (!src->active || now - src->last_packet_time > SOURCE_TIMEOUT_US))
+            slot = src;
+    }
+
+    if (slot == NULL)
+        return NULL;
 
+    if (slot->active)
+    {
+        ESP_LOGI(TAG, "Source %08" PRIx32 " timed out", slot->ssrc);
+        deliver_packets(rtp, slot, true);
+    }
+
+    ESP_LOGI(TAG, "New source %08" PRIx32, ssrc);
+    source_init(slot, ssrc);
+
+    return slot;
+}
+
+/*
+ * Follow the sequence numbers of a source (RFC 3550 A.1). A jump of more
+ * than MAX_DROPOUT ahead or MAX_MISORDER behind is only followed once the
+ * next packet confirms it, which drops a single stray packet but resyncs on
+ * a sender that restarted. Returns false for a packet to drop.
+ */
+static bool check_sequence(rtp_t *rtp, rtp_source_t *src, uint16_t seq)
+{
+    uint16_t udelta = seq - src->jbuf.highest;
+
+    if (!src->jbuf.started || udelta < MAX_DROPOUT || udelta > RTP_SEQ_MOD - MAX_MISORDER)
+    {
+        src->bad_seq = RTP_SEQ_MOD + 1;
+        return true;
+    }
+
+    if (seq != src->bad_seq)
+    {
+        src->bad_seq = (seq + 1) & (RTP_SEQ_MOD - 1);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Source %08" PRIx32 " restarted at sequence number %u", src->ssrc, seq);
+    deliver_packets(rtp, src, true);
+    jbuf_init(&src->jbuf, RECV_REORDER_DEPTH);
+#if CONFIG_AUDIO_RTP_FEC
+    fec_decoder_init(&src->fec_dec);
+#endif
+    src->first_packet = 1;
+    src->bad_seq = RTP_SEQ_MOD + 1;
+    rtp->stats.resyncs++;
+
+    return true;
+}
+
+static void push_packet(rtp_t *rtp, struct rtp_buffer *b)
+{
+    struct rtp_header *hdr = (struct rtp_header *)b->data;
+
+    if (b->len <= RTP_HEADER_LEN || check_header(hdr) != 0)
+    {
+        release_buffer(rtp, b);
+        return;
+    }
+
+    // Parity is never audio, even when this end does not use it
+    if (hdr->pt == PAYLOAD_PT_FEC)
+    {
+#if CONFIG_AUDIO_RTP_FEC
+        push_parity(rtp, b);
+#else
+        release_buffer(rtp, b);
+#endif
+        return;
+    }
+
+    rtp_source_t *src = find_source(rtp, ntohl(hdr->ssrc), b->recv_time);
+    if (src == NULL)
+    {
+        rtp->stats.source_drops++;
+        release_buffer(rtp, b);
+        return;
+    }
+
+    src->last_packet_time = b->recv_time;
+    src->addr = b->from;
+    b->source = src - rtp->sources;
+
+    uint16_t seq = ntohs(hdr->sequence_number);
+    if (!check_sequence(rtp, src, seq))
+    {
+        rtp->stats.late++;
+        release_buffer(rtp, b);
+        return;
+    }
+
+    update_stats(rtp, src, hdr);
+
+    int ret = jbuf_insert(&src->jbuf, seq, b);
+    if (ret == -ENOSPC)
+    {
+        // Too far ahead, the sender probably restarted
+        deliver_packets(rtp, src, true);
+        jbuf_init(&src->jbuf, RECV_REORDER_DEPTH);
+        ret = jbuf_insert(&src->jbuf, seq, b);
+    }
+
+    if (ret == -EALREADY)
+    {
+        ESP_LOGW(TAG, "Duplicated packet");
+        rtp->stats.duplicates++;
+    }
+    else if (ret == -ETIME)
+    {
+        rtp->stats.late++;
+    }
+
+    if (ret != 0)
+    {
+        release_buffer(rtp, b);
+        return;
+    }
+
+    // Late and duplicated packets are not counted, the receiver reports compare this to the sequence numbers
+    src->packets++;
+
+#if CONFIG_AUDIO_RTP_FEC
+    fec_decoder_add_media(&src->fec_dec, b->data, b->len);
+#endif
+
+    deliver_packets(rtp, src, false);
+}
+
+// Fill in the header of a packet, in the room left before its payload
+static void write_header(rtp_t *rtp, uint8_t pt, bool marker, uint8_t *rtp_packet)
+{
     struct rtp_header *p = (struct rtp_header *)rtp_packet;
     memset(p, 0, sizeof(*p));
 
     p->version = 2;
+    p->mark = marker;
     p->sequence_number = htons(++(rtp->last_seq));
-    p->ts = htonl((rtp->sent_bytes * 1000) / CONFIG_AUDIO_SAMPLE_RATE);
-    rtp->sent_bytes += *consumed;
-    p->pt = 96;
-    p->ssrc = htonl(0x42245987);
+    p->ts = htonl((uint32_t)rtp->sent_bytes);
+    p->pt = pt;
+    p->ssrc = htonl(rtp->ssrc);
+}
+
+// Report the reception quality of a source since its previous report (RFC 3550 6.4.2)
+static void send_report(rtp_t *rtp, rtp_source_t *src)
+{
+    rtcp_report_t report;
+    uint8_t data[RTCP_RR_LEN];
+
+    uint32_t expected = src->packets + src->lost;
+    uint32_t expected_interval = expected - src->report_expected;
+    uint32_t lost_interval = src->lost - src->report_lost;
+
+    src->report_expected = expected;
+    src->report_lost = src->lost;
+
+    report.ssrc = src->ssrc;
+    report.fraction_lost = expected_interval ? MIN(255, (lost_interval << 8) / expected_interval) : 0;
+    report.cumulative_lost = src->lost;
+    report.highest_seq = (src->seq_cycles << 16) | (uint16_t)src->last_seq;
+    report.jitter = src->jitter >> 4;
+#if CONFIG_AUDIO_SYNC
+    if (src->synced)
+    {
+        // Lets the sender measure the round trip time (RFC 3550 6.4.1)
+        report.lsr = src->sr_ntp_mid;
+        report.dlsr = ((esp_timer_get_time() - src->sr_received) << 16) / 1000000;
+    }
+    else
+#endif
+    {
+        report.lsr = 0;
+        report.dlsr = 0;
+    }
 
-    memcpy(rtp_packet + RTP_HEADER_LEN, bytes, *consumed);
+    rtp->rtcp.dest_addr.sin_addr = src->addr;
+    udp_send_bytes(&rtp->rtcp, data, rtcp_build_rr(data, rtp->ssrc, &report));
 }
 
-static void rtp_recv_task(void *pvParameters)
+// Send the receiver reports that are due
+static void send_reports(rtp_t *rtp)
 {
-    rtp_t *rtp = (rtp_t *)pvParameters;
-    int len;
+    int64_t now = esp_timer_get_time();
 
-    ESP_LOGD(TAG, "Starting recv task");
+    if (now - rtp->last_report_time < RTCP_INTERVAL_US)
+        return;
+
+    for (int i = 0; i < RTP_MAX_SOURCES; i++)
+    {
+        if (rtp->sources[i].active && rtp->sources[i].packets > 0)
+            send_report(rtp, &rtp->sources[i]);
+    }
+    rtp->last_report_time = now;
+}
+
+#if CONFIG_AUDIO_SYNC
+// Map the timestamps of a source to the wallclock
+static void receive_sender_report(rtp_t *rtp, const uint8_t *data, size_t len, int64_t now)
+{
+    rtcp_sender_info_t info;
+    uint32_t ssrc;
 
-    uint8_t buf_ring[BUF_COUNT][BUF_SIZE];
-    // memset(buf_ring, 0, BUF_COUNT * BUF_SIZE);
-    uint8_t curr_buffer = 0;
+    if (rtcp_parse_sr(data, len, &ssrc, &info) != 0)
+        return;
 
-    while ((len = udp_next(&rtp->udp, buf_ring[curr_buffer], BUF_SIZE)) > 0)
+    // A report before the first packet of its source waits for the next one
+    rtp_source_t *src = lookup_source(rtp, ssrc);
+    if (src == NULL)
+        return;
+
+    src->synced = true;
+    src->sr_ts = info.rtp_ts;
+    src->sr_wallclock = sync_from_ntp(info.ntp_sec, info.ntp_frac);
+    src->sr_ntp_mid = (info.ntp_sec << 16) | (info.ntp_frac >> 16);
+    src->sr_received = now;
+    rtp->stats.sender_reports++;
+}
+#endif
+
+#if SYNC_RTCP_PORT
+// Read the RTCP port: the sender reports of the sources, and the receiver reports of a stream sharing it
+static void receive_control(rtp_t *rtp)
+{
+    uint8_t data[RTCP_MAX_LEN];
+    int len;
+
+    while ((len = udp_try_next(&rtp->rtcp, data, sizeof(data))) > 0)
     {
-        if (rtp->stop_requested)
-            break;
+#if CONFIG_AUDIO_RTP_ADAPT
+        rtcp_report_t report;
 
-        if (len < 0 && errno == -EAGAIN)
+        if (rtcp_parse_rr(data, len, &report) == 0)
         {
-            // Timed out
+            // Dropped when the stream sent does not take them
+            xQueueSend(rtp->reports, &report, 0);
             continue;
         }
-        int ret = push_packet(rtp, buf_ring[curr_buffer], len);
-        if (ret != 0)
-            continue;
+#endif
+        receive_sender_report(rtp, data, len, esp_timer_get_time());
+    }
+}
+#endif
+
+/*
+ * Receive one datagram, waiting up to RECV_TIMEOUT for it or not at all, and
+ * push it towards the player. Returns 1 when a datagram was received, 0 when
+ * there was none and a negative value on socket errors.
+ */
+static int receive_packet(rtp_t *rtp, bool wait)
+{
+    struct rtp_buffer *b;
+    int len;
+
+#if CONFIG_AUDIO_NET_IMPAIR && CONFIG_AUDIO_SINGLE_TASK
+    if (esp_timer_get_time() < rtp->stall_end)
+        return 0;
+#endif
+
+    // All buffers are waiting to be played, the datagrams wait in the socket meanwhile
+    if (xQueueReceive(rtp->free_queue, &b, wait ? RECV_TIMEOUT : 0) != pdPASS)
+    {
+        rtp->stats.recv_stalls++;
+        return 0;
+    }
+
+    if (wait)
+        len = udp_next(&rtp->udp, b->data, sizeof(b->data));
+    else
+        len = udp_try_next(&rtp->udp, b->data, sizeof(b->data));
+
+    if (len < 0)
+    {
+        release_buffer(rtp, b);
+
+        // Timed out
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+
+        ESP_LOGE(TAG, "Cannot receive: %d", errno);
+        return -errno;
+    }
+
+    b->len = len;
+    b->recv_time = esp_timer_get_time();
+    b->from = rtp->udp.src_addr.sin_addr;
+
+    // RTCP multiplexed with RTP (RFC 5761) must not be played
+    if (rtcp_is_rtcp(b->data, len))
+    {
+#if CONFIG_AUDIO_SYNC_RTCP_MUX
+        receive_sender_report(rtp, b->data, len, b->recv_time);
+#endif
+        release_buffer(rtp, b);
+        return 1;
+    }
+
+#if CONFIG_AUDIO_NET_IMPAIR
+    if (len <= RTP_HEADER_LEN)
+    {
+        release_buffer(rtp, b);
+        return 1;
+    }
+
+    uint32_t delay_ms;
+    enum impair_action action = impair_next(&rtp->impair, &delay_ms);
+
+    if (delay_ms)
+    {
+#if CONFIG_AUDIO_SINGLE_TASK
+        // The player task must not sleep: the datagrams wait in the socket instead
+        rtp->stall_end = b->recv_time + delay_ms * 1000;
+#else
+        vTaskDelay(pdMS_TO_TICKS(delay_ms));
+#endif
+    }
+
+    if (action == IMPAIR_DROP)
+    {
+        release_buffer(rtp, b);
+        return 1;
+    }
+
+    if (action == IMPAIR_HOLD && rtp->held == NULL)
+    {
+        // Keep this buffer aside and deliver it after the next packet
+        rtp->held = b;
+        return 1;
+    }
+
+    struct rtp_buffer *dup = NULL;
+    if (action == IMPAIR_DUPLICATE && xQueueReceive(rtp->free_queue, &dup, 0) == pdPASS)
+        memcpy(dup, b, sizeof(*b));
+#endif
+
+    push_packet(rtp, b);
+
+#if CONFIG_AUDIO_NET_IMPAIR
+    if (dup != NULL)
+        push_packet(rtp, dup);
+
+    if (rtp->held != NULL)
+    {
+        push_packet(rtp, rtp->held);
+        rtp->held = NULL;
+    }
+#endif
+
+    return 1;
+}
+
+/*
+ * Receive every datagram waiting in the socket, after waiting for the first
+ * one when wait is set. A burst delivered by Wi-Fi after retries is taken out
+ * of the stack at once, before its mailbox overflows and drops the end of it.
+ * Returns the number of datagrams, or a negative error.
+ */
+static int receive_burst(rtp_t *rtp, bool wait)
+{
+    int count = 0;
+    int ret;
+
+    while ((ret = receive_packet(rtp, wait && count == 0)) > 0)
+        count++;
+
+    if (count > 1)
+        rtp->stats.recv_bursts++;
+    if (count > rtp->stats.recv_batch_max)
+        rtp->stats.recv_batch_max = count;
+
+    return ret < 0 ? ret : count;
+}
+
+static void rtp_recv_task(void *pvParameters)
+{
+    rtp_t *rtp = (rtp_t *)pvParameters;
+
+    ESP_LOGD(TAG, "Starting recv task");
 
-        curr_buffer = (curr_buffer + 1) % BUF_COUNT;
+    while (!rtp->stop_requested)
+    {
+        send_reports(rtp);
+#if SYNC_RTCP_PORT
+        receive_control(rtp);
+#endif
+
+        if (receive_burst(rtp, true) < 0)
+            break;
     }
 
     ESP_LOGD(TAG, "Leaving...");
 
+    uint8_t c = 1;
+    xQueueSend(rtp->stop_queue, &c, 0);
+
+    memstats_task_remove(xTaskGetCurrentTaskHandle());
     rtp->task_handle = NULL;
     vTaskDelete(NULL);
 }
 
+#if CONFIG_AUDIO_SINGLE_TASK
+/*
+ * Process every datagram received since the previous call, from the player
+ * task. Returns the number of datagrams.
+ */
+int rtp_poll(rtp_t *rtp)
+{
+    send_reports(rtp);
+#if SYNC_RTCP_PORT
+    receive_control(rtp);
+#endif
+
+    int count = receive_burst(rtp, false);
+
+    return count > 0 ? count : 0;
+}
+#endif
+
+#if CONFIG_AUDIO_RTP_ADAPT
+// The next receiver report received, from the RTCP socket or the receiving stream sharing it
+static bool next_report(rtp_t *rtp, rtcp_report_t *report)
+{
+    uint8_t data[RTCP_MAX_LEN];
+    int len;
+
+    if (rtp->reports != NULL)
+        return xQueueReceive(rtp->reports, report, 0) == pdPASS;
+
+    while ((len = udp_try_next(&rtp->rtcp, data, sizeof(data))) > 0)
+    {
+        if (rtcp_parse_rr(data, len, report) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+// Adapt the payload format to the receiver reports received since the last packet
+static void poll_reports(rtp_t *rtp)
+{
+    rtcp_report_t report;
+
+    while (next_report(rtp, &report))
+    {
+        if (report.ssrc != rtp->ssrc)
+            continue;
+
+        rtp->stats.reports++;
+        rtp->stats.last_report = report;
+
+        uint32_t jitter_us = ((uint64_t)report.jitter * 1000000) / CONFIG_AUDIO_SAMPLE_RATE;
+        if (adapt_update(&rtp->adapt, report.fraction_lost, jitter_us))
+        {
+            const payload_format_t *format = payload_format(rtp->adapt.level);
+            ESP_LOGI(TAG, "Receiver reports %u/256 lost, %" PRIu32 " us jitter: sending at 1/%u rate (PT %u)",
+                     report.fraction_lost, jitter_us, format->decimation, format->pt);
+        }
+    }
+}
+#endif
+
+#if !CONFIG_AUDIO_SINGLE_TASK
+static void send_timer_callback(void *arg)
+{
+    rtp_t *rtp = arg;
+
+    sched_wake(&rtp->latency);
+    xTaskNotifyGive(rtp->task_handle);
+}
+#endif
+
+// Send a packed RTP packet, followed by the FEC parity packet it completes
+static void send_datagram(rtp_t *rtp, uint8_t *rtp_data, size_t rtp_len)
+{
+#if CONFIG_AUDIO_RTP_FEC
+    uint8_t fec_data[MAX_PACKET_LEN];
+#endif
+
+    udp_send_bytes(&rtp->udp, rtp_data, rtp_len);
+
+#if CONFIG_AUDIO_RTP_FEC
+    size_t fec_len = fec_encoder_add(&rtp->fec_enc, rtp_data, rtp_len, fec_data);
+    if (fec_len > 0)
+    {
+        udp_send_bytes(&rtp->udp, fec_data, fec_len);
+        rtp->stats.fec_sent++;
+    }
+#endif
+
+    rtp->stats.sent_octets += rtp_len - RTP_HEADER_LEN;
+
+    int64_t now = esp_timer_get_time();
+    if (rtp->stats.sent > 0 && now - rtp->stats.last_send_time > rtp->stats.send_max_gap_us)
+        rtp->stats.send_max_gap_us = now - rtp->stats.last_send_time;
+    rtp->stats.last_send_time = now;
+    rtp->stats.sent++;
+}
+
+#if CONFIG_AUDIO_SYNC
+/*
+ * Tell the receiver which timestamp the stream is at on the wallclock, every
+ * RTCP_INTERVAL_US. The report goes to its RTCP port, or to the RTP port with
+ * CONFIG_AUDIO_SYNC_RTCP_MUX (RFC 5761). The next packet sent carries this
+ * timestamp: the playout delay counts from now.
+ */
+static void send_sender_report(rtp_t *rtp)
+{
+    rtcp_sender_info_t info;
+    uint8_t data[RTCP_SR_LEN];
+    int64_t now = esp_timer_get_time();
+
+    if (!sync_clock_set() || (rtp->stats.sender_reports > 0 && now - rtp->last_report_time < RTCP_INTERVAL_US))
+        return;
+
+    sync_to_ntp(sync_wallclock(now), &info.ntp_sec, &info.ntp_frac);
+    info.rtp_ts = (uint32_t)rtp->sent_bytes;
+    info.packets = rtp->stats.sent;
+    info.octets = rtp->stats.sent_octets;
+
+#if CONFIG_AUDIO_SYNC_RTCP_MUX
+    udp_send_bytes(&rtp->udp, data, rtcp_build_sr(data, rtp->ssrc, &info));
+#else
+    udp_send_bytes(&rtp->rtcp, data, rtcp_build_sr(data, rtp->ssrc, &info));
+#endif
+    rtp->stats.sender_reports++;
+    rtp->last_report_time = now;
+}
+#endif
+
+#if CONFIG_AUDIO_VAD
+/*
+ * A silent packet is replaced by a comfort noise packet at the start of the
+ * silence and every CN_INTERVAL_PACKETS, and not sent otherwise. The
+ * timestamps keep counting the samples.
+ */
+static void send_silence(rtp_t *rtp)
+{
+    if (rtp->cn_countdown == 0)
+    {
+        uint8_t cn_data[RTP_HEADER_LEN + 1];
+
+        write_header(rtp, PAYLOAD_PT_CN, false, cn_data);
+        cn_data[RTP_HEADER_LEN] = vad_noise_level(&rtp->vad);
+        send_datagram(rtp, cn_data, sizeof(cn_data));
+        rtp->stats.cn_sent++;
+        rtp->cn_countdown = CN_INTERVAL_PACKETS;
+    }
+    else
+    {
+        rtp->cn_countdown--;
+        rtp->stats.suppressed++;
+        // The slot was not missed, do not count it as a gap
+        rtp->stats.last_send_time = esp_timer_get_time();
+    }
+
+#if CONFIG_AUDIO_RTP_ADAPT
+    // The samples carried over by the last decimated packet are part of the silence
+    rtp->sent_bytes += rtp->carry_len;
+    rtp->carry_len = 0;
+#endif
+    rtp->sent_bytes += SEND_PAYLOAD_LEN;
+}
+#endif
+
+#if CONFIG_AUDIO_RTP_ADAPT
+/*
+ * Reduce the captured samples to the rate of the format, in place. The
+ * samples that do not make a complete group (SEND_PAYLOAD_LEN is 882 at the
+ * default settings) are carried to the front of the next packet, so that none
+ * is dropped and the timestamps keep following the capture. Returns the
+ * payload length.
+ */
+static size_t decimate_payload(rtp_t *rtp, uint8_t *payload, uint8_t factor)
+{
+    size_t len = rtp->carry_len + SEND_PAYLOAD_LEN;
+    size_t rest = len % factor;
+
+    if (rtp->carry_len > 0)
+    {
+        memmove(payload + rtp->carry_len, payload, SEND_PAYLOAD_LEN);
+        memcpy(payload, rtp->carry, rtp->carry_len);
+    }
+
+    memcpy(rtp->carry, payload + len - rest, rest);
+    rtp->carry_len = rest;
+
+    return payload_decimate(payload, len - rest, factor, payload);
+}
+#endif
+
+// Send a captured packet of SEND_PAYLOAD_LEN samples, the header and the payload are written in place
+static void send_packet(rtp_t *rtp, uint8_t *packet)
+{
+    bool marker = false;
+
+#if CONFIG_AUDIO_RTP_ADAPT
+    poll_reports(rtp);
+    const payload_format_t *format = payload_format(rtp->adapt.level);
+#else
+    const payload_format_t *format = payload_format(0);
+#endif
+
+#if CONFIG_AUDIO_SYNC
+    send_sender_report(rtp);
+#endif
+
+#if CONFIG_AUDIO_VAD
+    bool was_active = rtp->vad.active;
+
+    if (!vad_update(&rtp->vad, packet + RTP_HEADER_LEN, SEND_PAYLOAD_LEN))
+    {
+        send_silence(rtp);
+        return;
+    }
+
+    // First packet of a talkspurt, the receiver may adjust its playout there
+    marker = !was_active;
+    rtp->cn_countdown = 0;
+#endif
+
+#if CONFIG_AUDIO_RTP_ADAPT
+    size_t payload_len = decimate_payload(rtp, packet + RTP_HEADER_LEN, format->decimation);
+#else
+    size_t payload_len = SEND_PAYLOAD_LEN;
+#endif
+    write_header(rtp, format->pt, marker, packet);
+    // L8 mono: one timestamp unit per sample at the full rate, whatever the payload format
+    rtp->sent_bytes += payload_len * format->decimation;
+    send_datagram(rtp, packet, RTP_HEADER_LEN + payload_len);
+}
+
+/*
+ * Where to write the next captured samples: the payload of the packet being
+ * captured, after the room left for its header. *space is the number of
+ * samples that still fit in it. The samples are then sent without being
+ * copied again until the socket.
+ */
+uint8_t *rtp_send_buffer(rtp_t *rtp, size_t *space)
+{
+#if !CONFIG_AUDIO_SINGLE_TASK
+    if (rtp->filling == NULL)
+    {
+        // The sender is too far behind: drop the oldest packet rather than block the capture
+        if (xQueueReceive(rtp->send_free, &rtp->filling, 0) != pdPASS)
+        {
+            xQueueReceive(rtp->send_queue, &rtp->filling, portMAX_DELAY);
+            rtp->stats.send_overflows++;
+        }
+        rtp->filling_len = 0;
+    }
+#endif
+
+    *space = SEND_PAYLOAD_LEN - rtp->filling_len;
+    return rtp->filling + RTP_HEADER_LEN + rtp->filling_len;
+}
+
+// Account for length samples written at rtp_send_buffer
+void rtp_send_commit(rtp_t *rtp, size_t length)
+{
+    rtp->filling_len += length;
+    if (rtp->filling_len < SEND_PAYLOAD_LEN)
+        return;
+
+#if CONFIG_AUDIO_SINGLE_TASK
+    // Sent right away: the capture clock paces the stream
+    send_packet(rtp, rtp->filling);
+    rtp->filling_len = 0;
+#else
+    xQueueSend(rtp->send_queue, &rtp->filling, 0);
+    rtp->filling = NULL;
+#endif
+}
+
+#if !CONFIG_AUDIO_SINGLE_TASK
 static void rtp_send_task(void *pvParameters)
 {
     rtp_t *rtp = (rtp_t *)pvParameters;
-    size_t len;
-    void *item = NULL;
-    uint8_t rtp_data[MAX_PACKET_LEN];
+    uint8_t *packet;
+    uint32_t slots;
 
     ESP_LOGD(TAG, "Starting send task");
 
-    while ((item = xRingbufferReceive(rtp->ring_buffer, &len, portMAX_DELAY)) != NULL)
+    // Woken up by the send timer, once per ptime, or by rtp_stop
+    while ((slots = ulTaskNotifyTake(pdTRUE, portMAX_DELAY)) > 0 && !rtp->stop_requested)
     {
-        uint8_t *buf = item;
+        sched_running(&rtp->latency);
+
+        if (slots > 1)
+            rtp->stats.send_late += slots - 1;
 
-        while (len > 0)
+        // Never let the sender fall behind the capture by more than the queue depth
+        while (uxQueueMessagesWaiting(rtp->send_queue) > CONFIG_AUDIO_RTP_SEND_QUEUE_PACKETS)
         {
-            size_t rtp_len;
-            size_t bytes_consumed;
-            pack_rtp(rtp, buf, len, rtp_data, &bytes_consumed, &rtp_len);
-            udp_send_bytes(&rtp->udp, rtp_data, rtp_len);
-            buf += bytes_consumed;
-            len -= bytes_consumed;
+            xQueueReceive(rtp->send_queue, &packet, 0);
+            xQueueSend(rtp->send_free, &packet, 0);
+            rtp->stats.send_overflows++;
         }
 
-        vRingbufferReturnItem(rtp->ring_buffer, item);
+        if (xQueueReceive(rtp->send_queue, &packet, 0) != pdPASS)
+        {
+            rtp->stats.send_underruns++;
+            continue;
+        }
+
+        send_packet(rtp, packet);
+        xQueueSend(rtp->send_free, &packet, 0);
     }
 
     ESP_LOGD(TAG, "Leaving...");
+
+    uint8_t c = 1;
+    xQueueSend(rtp->stop_queue, &c, 0);
+
+    memstats_task_remove(xTaskGetCurrentTaskHandle());
+    rtp->task_handle = NULL;
+    vTaskDelete(NULL);
 }
+#endif
 
-void rtp_push_data(rtp_t *rtp, const uint8_t *data, size_t length)
+/*
+ * Hand the whole send pool to the capture, starting with its first packet.
+ * What a previous run left captured or queued is dropped.
+ */
+static void send_pool_reset(rtp_t *rtp)
 {
-    xRingbufferSend(rtp->ring_buffer, data, length, (TickType_t)portMAX_DELAY);
+    rtp->filling = rtp->send_pool;
+    rtp->filling_len = 0;
+#if CONFIG_AUDIO_RTP_ADAPT
+    rtp->carry_len = 0;
+#endif
+
+#if !CONFIG_AUDIO_SINGLE_TASK
+    xQueueReset(rtp->send_free);
+    xQueueReset(rtp->send_queue);
+
+    for (int i = 1; i < SEND_PACKETS; i++)
+    {
+        uint8_t *packet = rtp->send_pool + i * SEND_SLOT_LEN;
+        xQueueSend(rtp->send_free, &packet, 0);
+    }
+#endif
 }
 
 esp_err_t rtp_start(rtp_t *rtp)
 {
+    BaseType_t ret = pdPASS;
+
     rtp->stop_requested = false;
+    rtp->task_handle = NULL;
+
+    if (rtp->direction == RTP_SEND)
+        send_pool_reset(rtp);
+
+#if CONFIG_AUDIO_RTP_ADAPT
+    // Not in rtp_init: with rtp_share_socket, the receiving stream has bound the port already
+    if (rtp->direction == RTP_SEND && rtp->reports == NULL)
+    {
+        audio_udp_bind(&rtp->rtcp);
+        // The sender reports still go to the receiver
+        rtp->rtcp.dest_addr.sin_addr = rtp->udp.dest_addr.sin_addr;
+    }
+#endif
+
+#if !CONFIG_AUDIO_SINGLE_TASK
+    memstats_begin(MEM_RTP);
+
+    rtp->stop_queue = xQueueCreate(1, sizeof(uint8_t));
 
     if (rtp->direction == RTP_RECV)
-        return xTaskCreate(rtp_recv_task, "rtp_recv", 4096 + (BUF_COUNT * BUF_SIZE) * sizeof(StackType_t), rtp, 5, &rtp->task_handle);
+    {
+        ret = sched_task_create(SCHED_RTP_RECV, rtp_recv_task, "rtp_recv", RECV_TASK_STACK, rtp, &rtp->task_handle);
+        if (ret == pdPASS)
+            memstats_task_add(rtp->task_handle, RECV_TASK_STACK);
+    }
     else
-        return xTaskCreate(rtp_send_task, "rtp_send", 4096 + (BUF_COUNT * BUF_SIZE) * sizeof(StackType_t), rtp, 5, &rtp->task_handle);
+    {
+        ret = sched_task_create(SCHED_RTP_SEND, rtp_send_task, "rtp_send", SEND_TASK_STACK, rtp, &rtp->task_handle);
+        if (ret == pdPASS)
+        {
+            memstats_task_add(rtp->task_handle, SEND_TASK_STACK);
+
+            const esp_timer_create_args_t timer_args = {
+                .callback = send_timer_callback,
+                .arg = rtp,
+                .name = "rtp_send",
+            };
+            ESP_ERROR_CHECK(esp_timer_create(&timer_args, &rtp->send_timer));
+            ESP_ERROR_CHECK(esp_timer_start_periodic(rtp->send_timer, SEND_PERIOD_US));
+        }
+    }
+
+    memstats_end();
+#endif
+
+    return ret;
 }
 
+/*
+ * With CONFIG_AUDIO_SINGLE_TASK, the player or recorder task must not use
+ * the rtp stream anymore when this is called.
+ */
 void rtp_stop(rtp_t *rtp)
 {
+#if !CONFIG_AUDIO_SINGLE_TASK
     if (rtp->direction == RTP_RECV)
     {
-        struct rtp_packet p = {0};
-        xQueueSend(rtp->queue, &p, (TickType_t)portMAX_DELAY);
+        uint8_t c;
+        struct rtp_buffer *b = NULL;
+
+        // The receive task checks for it at least every RECV_TIMEOUT
         rtp->stop_requested = true;
+        xQueueReceive(rtp->stop_queue, &c, portMAX_DELAY);
+        vQueueDelete(rtp->stop_queue);
+
+        // Wake the player up
+        xQueueSend(rtp->queue, &b, (TickType_t)portMAX_DELAY);
     }
     else
     {
-        vTaskDelete(rtp->task_handle);
-        rtp->task_handle = NULL;
+        uint8_t c;
+
+        memstats_begin(MEM_RTP);
+        esp_timer_stop(rtp->send_timer);
+        esp_timer_delete(rtp->send_timer);
+        memstats_end();
+
+        // No send slot comes anymore, the task is woken up to leave
+        rtp->stop_requested = true;
+        xTaskNotifyGive(rtp->task_handle);
+        xQueueReceive(rtp->stop_queue, &c, portMAX_DELAY);
+        vQueueDelete(rtp->stop_queue);
     }
+#endif
 
-    udp_stop(&rtp->udp);
+    if (!rtp->shared_socket)
+        udp_stop(&rtp->udp);
+#if CONFIG_AUDIO_RTP_ADAPT
+    // Closed by the receiving stream sharing it
+    if (rtp->direction == RTP_SEND && rtp->reports != NULL)
+        return;
+#endif
+    udp_stop(&rtp->rtcp);
 }
 
-uint8_t *rtp_next_packet(rtp_t *rtp, size_t *length)
+/*
+ * Returns the payload of the next packet to play, or NULL once stopped.
+ * A length of 0 stands for a missing packet of that source. The previous
+ * payload is not valid anymore after this call.
+ */
+uint8_t *rtp_next_packet(rtp_t *rtp, size_t *length, uint8_t *pt, uint8_t *source)
 {
-    struct rtp_packet p;
-    BaseType_t ret = xQueueReceive(rtp->queue, &p, (TickType_t)portMAX_DELAY);
+    struct rtp_buffer *b;
+
+    if (rtp->current != NULL)
+    {
+        release_buffer(rtp, rtp->current);
+        rtp->current = NULL;
+    }
+
+    BaseType_t ret = xQueueReceive(rtp->queue, &b, (TickType_t)portMAX_DELAY);
     if (ret == errQUEUE_EMPTY)
     {
         ESP_LOGE(TAG, "Packet queue receive timed out.");
@@ -269,6 +1332,130 @@ uint8_t *rtp_next_packet(rtp_t *rtp, size_t *length)
         return NULL;
     }
 
-    *length = p.len;
-    return p.data;
+    if (b == NULL)
+        return NULL;
+
+    rtp->current = b;
+    *source = b->source;
+
+    if (b->len == 0)
+    {
+        *length = 0;
+        *pt = 0;
+        return b->data;
+    }
+
+    int64_t latency = esp_timer_get_time() - b->recv_time;
+    rtp->stats.latency_sum_us += latency;
+    rtp->stats.latency_count++;
+    if (latency > rtp->stats.latency_max_us)
+        rtp->stats.latency_max_us = latency;
+
+    *length = b->len - RTP_HEADER_LEN;
+    *pt = ((struct rtp_header *)b->data)->pt;
+    return b->data + RTP_HEADER_LEN;
+}
+
+#if CONFIG_AUDIO_SYNC
+/*
+ * Wallclock time at which the first sample of the packet returned by
+ * rtp_next_packet is to be heard, or 0 when its source did not send a sender
+ * report yet.
+ */
+int64_t rtp_play_time(rtp_t *rtp)
+{
+    return rtp->current != NULL && rtp->current->len > 0 ? rtp->current->play_time : 0;
+}
+#endif
+
+// Whether rtp_next_packet would return without waiting
+bool rtp_packet_waiting(rtp_t *rtp)
+{
+    return uxQueueMessagesWaiting(rtp->queue) > 0;
+}
+
+// Number of sources that sent a packet recently
+unsigned int rtp_active_sources(rtp_t *rtp)
+{
+    int64_t now = esp_timer_get_time();
+    unsigned int count = 0;
+
+    for (int i = 0; i < RTP_MAX_SOURCES; i++)
+    {
+        if (rtp->sources[i].active && now - rtp->sources[i].last_packet_time <= SOURCE_TIMEOUT_US)
+            count++;
+    }
+
+    return count;
+}
+
+void rtp_log_stats(rtp_t *rtp)
+{
+    rtp_stats_t *s = &rtp->stats;
+
+    if (rtp->direction == RTP_SEND)
+    {
+        ESP_LOGI(TAG, "RTP sent: %" PRIu32 ", underruns: %" PRIu32 ", overflows: %" PRIu32 ", late: %" PRIu32 ", max gap: %" PRId64 " us (ptime %d ms)",
+                 s->sent, s->send_underruns, s->send_overflows, s->send_late, s->send_max_gap_us, CONFIG_AUDIO_RTP_PTIME_MS);
+#if CONFIG_AUDIO_RTP_FEC
+        ESP_LOGI(TAG, "FEC parity packets sent: %" PRIu32 " (1 every %d packets)", s->fec_sent, FEC_GROUP);
+#endif
+#if !CONFIG_AUDIO_SINGLE_TASK
+        sched_latency_log(&rtp->latency, "RTP send");
+#endif
+#if CONFIG_AUDIO_VAD
+        ESP_LOGI(TAG, "Comfort noise packets sent: %" PRIu32 ", silent packets not sent: %" PRIu32, s->cn_sent, s->suppressed);
+        vad_log_stats(&rtp->vad);
+#endif
+#if CONFIG_AUDIO_SYNC
+        ESP_LOGI(TAG, "Sender reports sent: %" PRIu32, s->sender_reports);
+#endif
+#if CONFIG_AUDIO_RTP_ADAPT
+        const payload_format_t *format = payload_format(rtp->adapt.level);
+        ESP_LOGI(TAG, "Receiver reports: %" PRIu32 ", last loss: %u/256, last jitter: %" PRIu64 " us, rate: 1/%u (PT %u), switches: %" PRIu32,
+                 s->reports, s->last_report.fraction_lost, ((uint64_t)s->last_report.jitter * 1000000) / CONFIG_AUDIO_SAMPLE_RATE,
+                 format->decimation, format->pt, rtp->adapt.switches);
+#endif
+        return;
+    }
+
+    uint32_t errors = s->lost + s->late + s->duplicates;
+    uint32_t expected = s->packets + s->lost;
+
+    ESP_LOGI(TAG, "RTP packets: %" PRIu32 ", lost: %" PRIu32 ", recovered: %" PRIu32 ", out of order: %" PRIu32 ", late: %" PRIu32 ", duplicates: %" PRIu32,
+             s->packets, s->lost, s->recovered, s->out_of_order, s->late, s->duplicates);
+    ESP_LOGI(TAG, "Queue latency avg: %" PRId64 " us, max: %" PRId64 " us, packet errors: %" PRIu32 " per mille",
+             s->latency_count ? s->latency_sum_us / s->latency_count : 0, s->latency_max_us,
+             expected ? (errors * 1000) / expected : 0);
+    for (int i = 0; i < RTP_MAX_SOURCES; i++)
+    {
+        rtp_source_t *src = &rtp->sources[i];
+
+        if (!src->active)
+            continue;
+
+        ESP_LOGI(TAG, "Source %08" PRIx32 ": packets: %" PRIu32 ", lost: %" PRIu32 ", interarrival jitter: %" PRIu64 " us",
+                 src->ssrc, src->packets, src->lost, ((uint64_t)(src->jitter >> 4) * 1000000) / CONFIG_AUDIO_SAMPLE_RATE);
+#if CONFIG_AUDIO_SYNC
+        if (src->synced)
+            ESP_LOGI(TAG, "Source %08" PRIx32 ": last sender report %" PRId64 " ms ago",
+                     src->ssrc, (esp_timer_get_time() - src->sr_received) / 1000);
+        else
+            ESP_LOGW(TAG, "Source %08" PRIx32 ": no sender report, not synchronized", src->ssrc);
+#endif
+    }
+#if CONFIG_AUDIO_SYNC
+    ESP_LOGI(TAG, "Sender reports received: %" PRIu32, s->sender_reports);
+#endif
+    ESP_LOGI(TAG, "Receive bursts: %" PRIu32 ", largest: %" PRIu32 " datagrams, all buffers in use: %" PRIu32 " times",
+             s->recv_bursts, s->recv_batch_max, s->recv_stalls);
+    if (s->resyncs)
+        ESP_LOGI(TAG, "Sources that restarted their sequence numbers: %" PRIu32, s->resyncs);
+    if (s->source_drops)
+        ESP_LOGW(TAG, "Packets dropped from extra sources: %" PRIu32 " (max %d sources)", s->source_drops, RTP_MAX_SOURCES);
+
+#if CONFIG_AUDIO_NET_IMPAIR
+    if (rtp->direction == RTP_RECV)
+        impair_log_stats(&rtp->impair);
+#endif
 }
\ No newline at end of file
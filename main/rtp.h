@@ -10,9 +10,65 @@
 #include <stddef.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
-#include <freertos/ringbuf.h>
+#include <esp_timer.h>
+#include <arpa/inet.h>
 
+#include "jbuf.h"
+#include "payload.h"
+#include "rtcp.h"
+#include "sched.h"
 #include "udp.h"
+#include "vad.h"
+#if CONFIG_AUDIO_RTP_ADAPT
+#include "adapt.h"
+#endif
+#if CONFIG_AUDIO_NET_IMPAIR
+#include "impair.h"
+#endif
+#if CONFIG_AUDIO_RTP_FEC
+#include "fec.h"
+#endif
+#if CONFIG_AUDIO_SYNC
+#include "sync.h"
+#endif
+
+#define RTP_HEADER_LEN 12
+#define RTP_MAX_PACKET_LEN 1400
+
+// Stack used to send a packet (its FEC parity packet or a comfort noise packet), by rtp_send_commit with CONFIG_AUDIO_SINGLE_TASK
+#if CONFIG_AUDIO_RTP_FEC
+#define RTP_SEND_STACK (RTP_MAX_PACKET_LEN + 64)
+#else
+#define RTP_SEND_STACK 64
+#endif
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+struct rtp_header
+{
+    uint8_t cc : 4;
+    uint8_t extension : 1;
+    uint8_t padding : 1;
+    uint8_t version : 2;
+    uint8_t pt : 7;
+    uint8_t mark : 1;
+    uint16_t sequence_number;
+    uint32_t ts;
+    uint32_t ssrc;
+};
+#else
+struct rtp_header
+{
+    uint8_t version : 2;
+    uint8_t padding : 1;
+    uint8_t extension : 1;
+    uint8_t cc : 4;
+    uint8_t mark : 1;
+    uint8_t pt : 7;
+    uint16_t sequence_number;
+    uint32_t ts;
+    uint32_t ssrc;
+};
+#endif
 
 enum rtp_direction
 {
@@ -20,22 +76,134 @@ enum rtp_direction
     RTP_RECV
 };
 
+typedef struct rtp_stats
+{
+    uint32_t packets;
+    uint32_t lost;
+    uint32_t recovered;    // Rebuilt by FEC
+    uint32_t out_of_order;
+    uint32_t late;         // Arrived after being reported lost
+    uint32_t duplicates;
+    int64_t latency_sum_us;
+    int64_t latency_max_us;
+    uint32_t latency_count;
+    uint32_t source_drops;    // Packets from a new source while all source slots were taken
+    uint32_t resyncs;         // Sources that restarted their sequence numbers
+    uint32_t recv_bursts;     // Wakeups that found more than one datagram waiting
+    uint32_t recv_batch_max;  // Most datagrams received in one wakeup
+    uint32_t recv_stalls;     // Receptions delayed because all the buffers were in use
+    uint32_t sender_reports;  // Received, or sent when sending, with CONFIG_AUDIO_SYNC
+
+    uint32_t sent;
+    uint32_t fec_sent;
+    uint32_t send_underruns; // No complete packet available at send time
+    uint32_t send_overflows; // Packets dropped to keep the send queue bounded
+    uint32_t send_late;      // Send slots missed because the task was late
+    uint32_t cn_sent;        // Comfort noise packets, counted in sent too
+    uint32_t suppressed;     // Silent packets not sent
+    uint32_t sent_octets;    // Payload bytes, for the sender reports
+    int64_t last_send_time;
+    int64_t send_max_gap_us;
+    uint32_t reports;         // Receiver reports received
+    rtcp_report_t last_report;
+} rtp_stats_t;
+
+#define RTP_MAX_SOURCES CONFIG_AUDIO_RTP_MAX_SOURCES
+
+// Receive state of one sender, identified by its SSRC
+typedef struct rtp_source
+{
+    bool active;
+    uint32_t ssrc;
+    struct in_addr addr; // Of its sender, where its receiver reports go
+    int32_t last_seq;
+    uint8_t first_packet;
+    int64_t last_packet_time;
+    uint32_t packets;
+    uint32_t lost;
+    uint32_t jitter;          // RFC 3550 interarrival jitter, in timestamp units * 16
+    int64_t last_transit;
+    uint32_t seq_cycles;      // Sequence number wrap arounds, for the extended highest sequence
+    uint32_t report_expected; // Packets expected when the last receiver report was sent
+    uint32_t report_lost;     // Packets lost when the last receiver report was sent
+    uint32_t bad_seq;         // Sequence number that would confirm a jump, RTP_SEQ_MOD + 1 for none
+    jbuf_t jbuf;
+#if CONFIG_AUDIO_RTP_FEC
+    fec_decoder_t fec_dec;
+#endif
+#if CONFIG_AUDIO_SYNC
+    bool synced;           // A sender report was received
+    uint32_t sr_ts;        // RTP timestamp of the last sender report
+    int64_t sr_wallclock;  // Its wallclock time
+    uint32_t sr_ntp_mid;   // Middle 32 bits of its NTP time, echoed in the receiver reports
+    int64_t sr_received;   // When it was received
+#endif
+} rtp_source_t;
+
+struct rtp_buffer;
+
 typedef struct rtp
 {
     QueueHandle_t queue;
-    RingbufHandle_t ring_buffer;
+    QueueHandle_t free_queue;
+    QueueHandle_t stop_queue;
+    struct rtp_buffer *pool;
+    struct rtp_buffer *current;
+    rtp_source_t sources[RTP_MAX_SOURCES];
+    uint8_t *send_pool;        // Packets being captured or waiting to be sent
+    QueueHandle_t send_free;
+    QueueHandle_t send_queue;  // Captured packets, for the send task
+    uint8_t *filling;          // Packet the capture is written into
+    size_t filling_len;        // Samples in it
     TaskHandle_t task_handle;
+    esp_timer_handle_t send_timer;
+    sched_latency_t latency; // Of the send task, from the send timer
     enum rtp_direction direction;
+    uint32_t ssrc; // Of the stream sent, and of the receiver reports
     int32_t last_seq;
-    uint8_t first_packet;
     uint64_t sent_bytes;
+    int64_t last_report_time;
     bool stop_requested;
+    rtp_stats_t stats;
     udp_t udp;
+    bool shared_socket; // udp is the socket of the receiving stream, see rtp_share_socket
+    udp_t rtcp;
+#if CONFIG_AUDIO_RTP_ADAPT
+    QueueHandle_t reports; // Receiver reports of the stream sent through a shared RTCP socket, see rtp_share_socket
+    adapt_t adapt;
+    uint8_t carry[PAYLOAD_MAX_DECIMATION - 1]; // Captured samples left over by the last decimation
+    size_t carry_len;
+#endif
+#if CONFIG_AUDIO_NET_IMPAIR
+    impair_t impair;
+    struct rtp_buffer *held;
+#if CONFIG_AUDIO_SINGLE_TASK
+    int64_t stall_end; // The socket is not read until then
+#endif
+#endif
+#if CONFIG_AUDIO_RTP_FEC
+    fec_encoder_t fec_enc;
+#endif
+#if CONFIG_AUDIO_VAD
+    vad_t vad;
+    uint8_t cn_countdown; // Silent packets before the next comfort noise packet
+#endif
 } rtp_t;
 
 void rtp_init(rtp_t *rtp, u_int16_t port, enum rtp_direction);
+void rtp_share_socket(rtp_t *rtp, const rtp_t *owner);
 esp_err_t rtp_start(rtp_t *rtp);
 void rtp_stop(rtp_t *rtp);
 void rtp_deinit(rtp_t *rtp);
-uint8_t *rtp_next_packet(rtp_t *rtp, size_t *length);
-void rtp_push_data(rtp_t *rtp, const uint8_t *data, size_t length);
+uint8_t *rtp_next_packet(rtp_t *rtp, size_t *length, uint8_t *pt, uint8_t *source);
+bool rtp_packet_waiting(rtp_t *rtp);
+#if CONFIG_AUDIO_SINGLE_TASK
+int rtp_poll(rtp_t *rtp);
+#endif
+unsigned int rtp_active_sources(rtp_t *rtp);
+uint8_t *rtp_send_buffer(rtp_t *rtp, size_t *space);
+void rtp_send_commit(rtp_t *rtp, size_t length);
+#if CONFIG_AUDIO_SYNC
+int64_t rtp_play_time(rtp_t *rtp);
+#endif
+void rtp_log_stats(rtp_t *rtp);
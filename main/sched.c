@@ -0,0 +1,105 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "sched.h"
+
+#include <esp_log.h>
+
+static const char *TAG = "sched";
+
+#if CONFIG_AUDIO_SCHED_REALTIME
+#if CONFIG_FREERTOS_UNICORE
+#define AUDIO_CORE 0
+#else
+#define AUDIO_CORE 1
+#endif
+// Wi-Fi, lwIP and the esp_timer task run there
+#define NETWORK_CORE 0
+/*
+ * Every socket call of the RTP tasks is run by the lwIP tcpip task: above it
+ * on its core, they would preempt the work they then wait for.
+ */
+#define NETWORK_PRIORITY_MAX (CONFIG_LWIP_TCPIP_TASK_PRIO - 1)
+
+static const struct
+{
+    UBaseType_t priority; // Below CONFIG_AUDIO_SCHED_PRIORITY
+    BaseType_t core;
+} profile[] = {
+    [SCHED_RTP_SEND] = {0, NETWORK_CORE},
+    [SCHED_RECORDER] = {1, AUDIO_CORE},
+    [SCHED_PLAYER] = {2, AUDIO_CORE},
+    [SCHED_RTP_RECV] = {3, NETWORK_CORE},
+};
+#endif
+
+BaseType_t sched_task_create(enum sched_task task, TaskFunction_t fn, const char *name, uint32_t stack_size, void *arg, TaskHandle_t *handle)
+{
+#if CONFIG_AUDIO_SCHED_REALTIME
+    UBaseType_t priority = CONFIG_AUDIO_SCHED_PRIORITY - profile[task].priority;
+    BaseType_t core = profile[task].core;
+
+    if (core == NETWORK_CORE && CONFIG_AUDIO_SCHED_PRIORITY > NETWORK_PRIORITY_MAX)
+        priority = NETWORK_PRIORITY_MAX - profile[task].priority;
+#else
+    UBaseType_t priority = 5;
+    BaseType_t core = tskNO_AFFINITY;
+#endif
+
+    ESP_LOGD(TAG, "%s: priority %u, core %d", name, (unsigned)priority, (int)core);
+
+    return xTaskCreatePinnedToCore(fn, name, stack_size, arg, priority, handle, core);
+}
+
+void sched_latency_init(sched_latency_t *latency, int64_t deadline)
+{
+    latency->woken = 0;
+    latency->deadline = deadline;
+    latency->wakeups = 0;
+    latency->missed = 0;
+    latency->total = 0;
+    latency->max = 0;
+}
+
+// Time of the last event not handled yet, 0 if none
+int64_t sched_woken(sched_latency_t *latency)
+{
+    uint32_t woken = latency->woken;
+    int64_t now = esp_timer_get_time();
+
+    if (woken == 0)
+        return 0;
+
+    return now - (uint32_t)((uint32_t)now - woken);
+}
+
+void sched_running(sched_latency_t *latency)
+{
+    int64_t woken = sched_woken(latency);
+
+    // Woken up by something else, like a stop request
+    if (woken == 0)
+        return;
+
+    int64_t delay = esp_timer_get_time() - woken;
+
+    latency->woken = 0;
+    latency->wakeups++;
+    latency->total += delay;
+    if (delay > latency->max)
+        latency->max = delay;
+    if (delay > latency->deadline)
+        latency->missed++;
+}
+
+void sched_latency_log(sched_latency_t *latency, const char *name)
+{
+    if (latency->wakeups == 0)
+        return;
+
+    ESP_LOGI(TAG, "%s wakeup latency avg: %" PRId64 " us, max: %" PRId64 " us, missed deadlines (%" PRId64 " ms): %" PRIu32,
+             name, latency->total / latency->wakeups, latency->max, latency->deadline / 1000, latency->missed);
+}
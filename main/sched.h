@@ -0,0 +1,73 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <sdkconfig.h>
+#include <esp_timer.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/*
+ * Scheduling of the audio tasks.
+ *
+ * With CONFIG_AUDIO_SCHED_REALTIME, the tasks handling the audio (player,
+ * recorder) are pinned to the app core, away from Wi-Fi, lwIP and the
+ * console, while the RTP tasks stay with the network stack on the protocol
+ * core. Priorities follow the deadlines: the send task must send every
+ * ptime, the recorder must read each ADC frame before the next one, the
+ * player must load a DAC buffer before the other ones are played and the
+ * receive task only feeds the jitter buffer. They are all above the console
+ * and below Wi-Fi. The RTP tasks also stay below the lwIP tcpip task
+ * (CONFIG_LWIP_TCPIP_TASK_PRIO), which runs every socket call they make:
+ * above it, a send would wait on a lower priority task on its own core.
+ * Otherwise, all tasks run at priority 5 on any core.
+ */
+enum sched_task
+{
+    SCHED_RTP_SEND,
+    SCHED_RECORDER,
+    SCHED_PLAYER,
+    SCHED_RTP_RECV,
+};
+
+BaseType_t sched_task_create(enum sched_task task, TaskFunction_t fn, const char *name, uint32_t stack_size, void *arg, TaskHandle_t *handle);
+
+/*
+ * Wakeup latency of a task paced by an interrupt or a timer: from the event
+ * (sched_wake(), from the ISR or callback) to the task handling it
+ * (sched_running()). A wakeup later than the deadline is a glitch: a DMA
+ * buffer played again, an ADC frame dropped or a packet sent late.
+ */
+typedef struct sched_latency
+{
+    /*
+     * Low 32 bits of the time of the last event, 0 once handled. Written in a
+     * single store, so that the task never reads half of it while the ISR
+     * runs on the other core. It wraps after 71 minutes, far above the
+     * latencies measured.
+     */
+    volatile uint32_t woken;
+    int64_t deadline;       // In us
+    uint32_t wakeups;
+    uint32_t missed;
+    int64_t total;
+    int64_t max;
+} sched_latency_t;
+
+void sched_latency_init(sched_latency_t *latency, int64_t deadline);
+int64_t sched_woken(sched_latency_t *latency);
+void sched_running(sched_latency_t *latency);
+void sched_latency_log(sched_latency_t *latency, const char *name);
+
+static inline void sched_wake(sched_latency_t *latency)
+{
+    uint32_t now = (uint32_t)esp_timer_get_time();
+
+    latency->woken = now != 0 ? now : 1;
+}
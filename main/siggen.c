@@ -0,0 +1,100 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "siggen.h"
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <sdkconfig.h>
+
+#define SAMPLE_SILENCE 128
+
+#define CLICK_LEN (CONFIG_AUDIO_SAMPLE_RATE / 1000)
+#define CHIRP_START_HZ 100
+#define CHIRP_END_HZ 8000
+
+#define SINE_BITS 8
+#define SINE_LEN (1 << SINE_BITS)
+
+static uint8_t sine[SINE_LEN];
+
+int siggen_parse(const char *name, enum siggen_type *type)
+{
+    if (strcmp(name, "mic") == 0)
+        *type = SIGGEN_NONE;
+    else if (strcmp(name, "click") == 0)
+        *type = SIGGEN_CLICK;
+    else if (strcmp(name, "chirp") == 0)
+        *type = SIGGEN_CHIRP;
+    else
+        return -EINVAL;
+
+    return 0;
+}
+
+void siggen_init(siggen_t *gen, enum siggen_type type)
+{
+    gen->type = type;
+    gen->pos = 0;
+    gen->phase = 0;
+    gen->phase_inc = 0;
+
+    if (type == SIGGEN_CHIRP && sine[0] == 0)
+    {
+        for (int i = 0; i < SINE_LEN; i++)
+            sine[i] = SAMPLE_SILENCE + (int)(127.0f * sinf(2.0f * (float)M_PI * i / SINE_LEN));
+    }
+}
+
+static void fill_click(siggen_t *gen, uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        data[i] = gen->pos < CLICK_LEN ? 255 : SAMPLE_SILENCE;
+
+        if (++gen->pos == CONFIG_AUDIO_SAMPLE_RATE)
+            gen->pos = 0;
+    }
+}
+
+static void fill_chirp(siggen_t *gen, uint8_t *data, size_t length)
+{
+    // Phase increments are in 1/2^32 of a period per sample
+    const uint32_t inc_start = ((uint64_t)CHIRP_START_HZ << 32) / CONFIG_AUDIO_SAMPLE_RATE;
+    const uint32_t inc_step = ((uint64_t)(CHIRP_END_HZ - CHIRP_START_HZ) << 32) / CONFIG_AUDIO_SAMPLE_RATE / CONFIG_AUDIO_SAMPLE_RATE;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (gen->pos == 0)
+        {
+            gen->phase = 0;
+            gen->phase_inc = inc_start;
+        }
+
+        data[i] = sine[gen->phase >> (32 - SINE_BITS)];
+        gen->phase += gen->phase_inc;
+        gen->phase_inc += inc_step;
+
+        if (++gen->pos == CONFIG_AUDIO_SAMPLE_RATE)
+            gen->pos = 0;
+    }
+}
+
+void siggen_fill(siggen_t *gen, uint8_t *data, size_t length)
+{
+    switch (gen->type)
+    {
+    case SIGGEN_CLICK:
+        fill_click(gen, data, length);
+        break;
+    case SIGGEN_CHIRP:
+        fill_chirp(gen, data, length);
+        break;
+    default:
+        break;
+    }
+}
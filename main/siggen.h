@@ -0,0 +1,37 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Test signals sent instead of the microphone samples.
+ *
+ * The signals are aligned on the RTP timestamps (one sample per timestamp
+ * unit, starting at 0) so that the peer can find where they were generated:
+ * - click: a 1 ms pulse at every multiple of the sample rate (once per second)
+ * - chirp: a linear sweep from 100 Hz to 8 kHz, restarting every second
+ */
+enum siggen_type
+{
+    SIGGEN_NONE,
+    SIGGEN_CLICK,
+    SIGGEN_CHIRP,
+};
+
+typedef struct siggen
+{
+    enum siggen_type type;
+    uint32_t pos;
+    uint32_t phase;
+    uint32_t phase_inc;
+} siggen_t;
+
+int siggen_parse(const char *name, enum siggen_type *type);
+void siggen_init(siggen_t *gen, enum siggen_type type);
+void siggen_fill(siggen_t *gen, uint8_t *data, size_t length);
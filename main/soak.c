@@ -0,0 +1,167 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "soak.h"
+
+#include <stdlib.h>
+#include <sdkconfig.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include "bench.h"
+#include "memstats.h"
+
+static const char *TAG = "soak";
+
+// For the idle task to free the stacks of the deleted tasks
+#define SOAK_SETTLE_MS 100
+
+enum soak_op
+{
+    SOAK_RECORDER_START,
+    SOAK_RECORDER_STOP,
+    SOAK_PLAYER_START,
+    SOAK_PLAYER_STOP,
+    SOAK_OP_COUNT,
+};
+
+static const char *op_names[SOAK_OP_COUNT] = {
+    [SOAK_RECORDER_START] = "recorder start",
+    [SOAK_RECORDER_STOP] = "recorder stop",
+    [SOAK_PLAYER_START] = "player start",
+    [SOAK_PLAYER_STOP] = "player stop",
+};
+
+typedef struct soak_totals
+{
+    uint32_t sent;     // Packets sent by the recorder
+    uint32_t injected; // Packets sent to the player
+    uint32_t received; // Packets received by the player
+    int64_t recording_us;
+} soak_totals_t;
+
+static int compare_latency(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint32_t elapsed_since(int64_t start)
+{
+    return esp_timer_get_time() - start;
+}
+
+static void run_cycle(audio_player_t *player, audio_recorder_t *recorder, const soak_params_t *params,
+                      bench_sender_t *sender, uint32_t *latency, soak_totals_t *totals)
+{
+    int64_t start = esp_timer_get_time();
+
+    audio_recorder_init(recorder);
+    audio_recorder_start(recorder);
+    latency[SOAK_RECORDER_START] = elapsed_since(start);
+    int64_t recording = esp_timer_get_time();
+
+    vTaskDelay(pdMS_TO_TICKS(params->stream_ms));
+
+    start = esp_timer_get_time();
+    totals->recording_us += start - recording;
+    audio_recorder_stop(recorder);
+    totals->sent += recorder->rtp.stats.sent;
+    audio_recorder_deinit(recorder);
+    latency[SOAK_RECORDER_STOP] = elapsed_since(start);
+
+    start = esp_timer_get_time();
+    audio_player_init(player);
+    audio_player_start(player);
+    latency[SOAK_PLAYER_START] = elapsed_since(start);
+
+    if (sender == NULL)
+    {
+        vTaskDelay(pdMS_TO_TICKS(params->stream_ms));
+    }
+    else
+    {
+        // Bursts at the stream rate on average
+        uint32_t period_ms = params->burst * CONFIG_AUDIO_RTP_PTIME_MS;
+
+        for (uint32_t t = 0; t < params->stream_ms; t += period_ms)
+        {
+            totals->injected += bench_send_burst(sender, params->burst);
+            vTaskDelay(pdMS_TO_TICKS(period_ms));
+        }
+    }
+
+    start = esp_timer_get_time();
+    audio_player_stop(player);
+    totals->received += player->rtp.stats.packets;
+    audio_player_deinit(player);
+    latency[SOAK_PLAYER_STOP] = elapsed_since(start);
+
+    vTaskDelay(pdMS_TO_TICKS(SOAK_SETTLE_MS));
+}
+
+void soak_run(audio_player_t *player, audio_recorder_t *recorder, const soak_params_t *params)
+{
+    uint32_t *latency = malloc(params->cycles * SOAK_OP_COUNT * sizeof(*latency));
+    uint32_t *sorted = malloc(params->cycles * sizeof(*sorted));
+    soak_totals_t totals = {0};
+    bench_sender_t sender;
+    bench_sender_t *bursts = NULL;
+    uint32_t first_free = 0;
+
+    if (latency == NULL || sorted == NULL)
+    {
+        ESP_LOGE(TAG, "Not enough memory for %" PRIu32 " cycles", params->cycles);
+        goto done;
+    }
+
+    if (params->burst > 0 && bench_sender_open(&sender) == 0)
+        bursts = &sender;
+
+    ESP_LOGI(TAG, "%" PRIu32 " cycles of %" PRIu32 " ms streams, bursts of %" PRIu32 " packets",
+             params->cycles, params->stream_ms, params->burst);
+
+    for (uint32_t cycle = 0; cycle < params->cycles; cycle++)
+    {
+        run_cycle(player, recorder, params, bursts, &latency[cycle * SOAK_OP_COUNT], &totals);
+
+        // The first cycle allocates long-lived resources (lwIP, drivers), compare with the end of it
+        if (cycle == 0)
+            first_free = esp_get_free_heap_size();
+    }
+
+    if (bursts != NULL)
+        bench_sender_close(bursts);
+
+    for (int op = 0; op < SOAK_OP_COUNT; op++)
+    {
+        uint32_t n = params->cycles;
+
+        for (uint32_t i = 0; i < n; i++)
+            sorted[i] = latency[i * SOAK_OP_COUNT + op];
+        qsort(sorted, n, sizeof(*sorted), compare_latency);
+
+        ESP_LOGI(TAG, "%-14s latency p50: %6" PRIu32 " us, p90: %6" PRIu32 " us, p99: %6" PRIu32 " us, max: %6" PRIu32 " us",
+                 op_names[op], sorted[(n - 1) * 50 / 100], sorted[(n - 1) * 90 / 100], sorted[(n - 1) * 99 / 100], sorted[n - 1]);
+    }
+
+    ESP_LOGI(TAG, "Recorder: %" PRIu32 " packets sent, %" PRIu64 " per s (%d expected)",
+             totals.sent, totals.recording_us > 0 ? ((uint64_t)totals.sent * 1000000) / totals.recording_us : 0,
+             1000 / CONFIG_AUDIO_RTP_PTIME_MS);
+    ESP_LOGI(TAG, "Player: %" PRIu32 " packets sent to it, %" PRIu32 " received", totals.injected, totals.received);
+    ESP_LOGI(TAG, "Heap lost since the first cycle: %" PRId32 " bytes, approximately udp: %" PRId32 ", rtp: %" PRId32 ", player: %" PRId32 ", recorder: %" PRId32 ", lowest free heap: %u bytes",
+             (int32_t)(first_free - esp_get_free_heap_size()), memstats_balance(MEM_UDP), memstats_balance(MEM_RTP),
+             memstats_balance(MEM_PLAYER), memstats_balance(MEM_RECORDER), (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+    memstats_log();
+
+done:
+    free(latency);
+    free(sorted);
+}
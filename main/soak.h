@@ -0,0 +1,34 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+
+#include "audio_player.h"
+#include "audio_recorder.h"
+
+/*
+ * Soak test, to run before a firmware rollout.
+ *
+ * Each cycle streams from the recorder, then plays with the player while
+ * bursts of packets are sent to it through the loopback interface, starting
+ * and stopping both. The report gives the start and stop latency percentiles,
+ * the throughput of both directions, the heap lost since the first cycle
+ * (which allocates the long-lived resources) and the stack usage.
+ */
+typedef struct soak_params
+{
+    uint32_t cycles;
+    uint32_t stream_ms; // Streaming time of each direction, per cycle
+    uint32_t burst;     // Packets per burst sent to the player, 0 for none
+} soak_params_t;
+
+#define SOAK_DEFAULT_PARAMS {.cycles = 20, .stream_ms = 1000, .burst = 4}
+#define SOAK_MAX_CYCLES 10000
+#define SOAK_MAX_STREAM_MS 60000
+
+void soak_run(audio_player_t *player, audio_recorder_t *recorder, const soak_params_t *params);
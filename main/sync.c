@@ -0,0 +1,83 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "sync.h"
+
+#include <sys/time.h>
+#include <sdkconfig.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_netif_sntp.h>
+
+static const char *TAG = "sync";
+
+// Seconds from the NTP epoch (1900) to the Unix epoch (1970)
+#define NTP_UNIX_OFFSET 2208988800ULL
+
+static volatile uint32_t updates;
+static volatile int64_t last_update; // esp_timer time
+
+static void time_updated(struct timeval *tv)
+{
+    if (updates++ == 0)
+        ESP_LOGI(TAG, "Wallclock set by %s", CONFIG_AUDIO_SYNC_NTP_SERVER);
+    last_update = esp_timer_get_time();
+}
+
+// Start SNTP, once the network is up
+void sync_clock_start(void)
+{
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_AUDIO_SYNC_NTP_SERVER);
+
+    // Slew the clock after the first update, a step would be heard as a playout correction
+    config.smooth_sync = true;
+    config.sync_cb = time_updated;
+
+    esp_err_t err = esp_netif_sntp_init(&config);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Cannot start SNTP: %s", esp_err_to_name(err));
+}
+
+// Whether SNTP set the wallclock, nothing is synchronized before
+bool sync_clock_set(void)
+{
+    return updates > 0;
+}
+
+// Wallclock at an esp_timer_get_time() time
+int64_t sync_wallclock(int64_t time)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - (esp_timer_get_time() - time);
+}
+
+void sync_to_ntp(int64_t wallclock, uint32_t *sec, uint32_t *frac)
+{
+    *sec = wallclock / 1000000 + NTP_UNIX_OFFSET;
+    *frac = ((uint64_t)(wallclock % 1000000) << 32) / 1000000;
+}
+
+int64_t sync_from_ntp(uint32_t sec, uint32_t frac)
+{
+    return ((int64_t)sec - NTP_UNIX_OFFSET) * 1000000 + (((uint64_t)frac * 1000000) >> 32);
+}
+
+void sync_clock_log(void)
+{
+    if (!sync_clock_set())
+    {
+        ESP_LOGW(TAG, "Wallclock not set yet by %s", CONFIG_AUDIO_SYNC_NTP_SERVER);
+        return;
+    }
+
+    int64_t now = sync_wallclock(esp_timer_get_time());
+
+    ESP_LOGI(TAG, "Wallclock: %" PRId64 ".%06" PRId64 " s, SNTP updates: %" PRIu32 ", last %" PRId64 " s ago",
+             now / 1000000, now % 1000000, updates, (esp_timer_get_time() - last_update) / 1000000);
+}
@@ -0,0 +1,27 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/*
+ * Wallclock shared by the units, for synchronized playout (CONFIG_AUDIO_SYNC).
+ *
+ * The system time of every unit is set by SNTP from the same server once
+ * Wi-Fi is up, then slewed at each update so that it never jumps. A sender
+ * tells which RTP timestamp its stream is at on this clock in RTCP sender
+ * reports, and the receivers play each packet at the wallclock time of its
+ * timestamp plus CONFIG_AUDIO_SYNC_DELAY_MS. Times are in us since the Unix
+ * epoch.
+ */
+void sync_clock_start(void);
+bool sync_clock_set(void);
+int64_t sync_wallclock(int64_t time);
+void sync_to_ntp(int64_t wallclock, uint32_t *sec, uint32_t *frac);
+int64_t sync_from_ntp(uint32_t sec, uint32_t frac);
+void sync_clock_log(void);
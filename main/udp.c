@@ -15,6 +15,7 @@
 #include <lwip/netdb.h>
 
 #include "udp.h"
+#include "memstats.h"
 
 static const char *TAG = "UDP";
 
@@ -28,7 +29,9 @@ int audio_udp_init(udp_t *udp, uint16_t port)
     udp->dest_addr.sin_family = AF_INET;
     udp->dest_addr.sin_port = htons(port);
 
+    memstats_begin(MEM_UDP);
     int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    memstats_end();
     if (sock < 0)
     {
         ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
@@ -53,8 +56,10 @@ void udp_stop(udp_t *udp)
     if (udp->sock > 0)
     {
         ESP_LOGD(TAG, "Shutting down socket");
+        memstats_begin(MEM_UDP);
         shutdown(udp->sock, 0);
         close(udp->sock);
+        memstats_end();
     }
 }
 
@@ -74,12 +79,40 @@ int audio_udp_bind(udp_t *udp)
     return 0;
 }
 
+static int udp_recv(udp_t *udp, uint8_t *data, size_t max_size, int flags)
+{
+    socklen_t socklen = sizeof(udp->src_addr);
+
+    return recvfrom(udp->sock, data, max_size, flags, (struct sockaddr *)&udp->src_addr, &socklen);
+}
+
+/*
+ * Bytes of datagrams the stack may queue for the socket. lwIP only enforces it
+ * with CONFIG_LWIP_SO_RCVBUF, its mailbox of CONFIG_LWIP_UDP_RECVMBOX_SIZE
+ * datagrams is the limit in any case.
+ */
+int udp_set_recv_buffer(udp_t *udp, int size)
+{
+#if CONFIG_LWIP_SO_RCVBUF
+    if (setsockopt(udp->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+    {
+        ESP_LOGW(TAG, "Cannot set the receive buffer to %d bytes: errno %d", size, errno);
+        return -errno;
+    }
+#endif
+
+    return 0;
+}
+
 int udp_next(udp_t *udp, uint8_t *data, size_t max_size)
 {
-    struct sockaddr_storage source_addr;
-    socklen_t socklen = sizeof(source_addr);
+    return udp_recv(udp, data, max_size, 0);
+}
 
-    return recvfrom(udp->sock, data, max_size, 0, (struct sockaddr *)&source_addr, &socklen);
+// Same as udp_next, but returns right away when nothing was received
+int udp_try_next(udp_t *udp, uint8_t *data, size_t max_size)
+{
+    return udp_recv(udp, data, max_size, MSG_DONTWAIT);
 }
 
 int udp_send_bytes(udp_t *udp, const uint8_t *data, size_t size)
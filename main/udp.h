@@ -12,10 +12,13 @@ typedef struct udp
 {
     int sock;
     struct sockaddr_in dest_addr;
+    struct sockaddr_in src_addr; // Source of the last received datagram
 } udp_t;
 
 int audio_udp_init(udp_t *udp, uint16_t port);
 void udp_stop(udp_t *udp);
 int audio_udp_bind(udp_t *udp);
+int udp_set_recv_buffer(udp_t *udp, int size);
 int udp_next(udp_t *udp, uint8_t *data, size_t max_size);
+int udp_try_next(udp_t *udp, uint8_t *data, size_t max_size);
 int udp_send_bytes(udp_t *udp, const uint8_t *data, size_t size);
\ No newline at end of file
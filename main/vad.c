@@ -0,0 +1,138 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "vad.h"
+
+#include <math.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sdkconfig.h>
+#include <esp_log.h>
+
+static const char *TAG = "vad";
+
+#define SILENCE 128
+// Mean square level of a full scale square wave
+#define FULL_SCALE_ENERGY (128 * 128)
+// Below one step of RMS, there is nothing to send
+#define MIN_ENERGY 1
+
+#if CONFIG_AUDIO_VAD
+#define HANGOVER_PACKETS (CONFIG_AUDIO_VAD_HANGOVER_MS / CONFIG_AUDIO_RTP_PTIME_MS)
+#define THRESHOLD_DB CONFIG_AUDIO_VAD_THRESHOLD_DB
+#else
+#define HANGOVER_PACKETS 0
+#define THRESHOLD_DB 0
+#endif
+
+void vad_init(vad_t *vad)
+{
+    memset(vad, 0, sizeof(*vad));
+    vad->noise = UINT32_MAX;
+    vad->threshold = 256.0f * powf(10.0f, THRESHOLD_DB / 10.0f);
+}
+
+static uint32_t mean_square(const uint8_t *samples, size_t length)
+{
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        int32_t s = (int32_t)samples[i] - SILENCE;
+        sum += s * s;
+    }
+
+    return length ? sum / length : 0;
+}
+
+// Returns whether the packet must be sent
+bool vad_update(vad_t *vad, const uint8_t *samples, size_t length)
+{
+    uint32_t energy = mean_square(samples, length);
+    uint32_t level = energy << 8;
+
+    vad->energy = energy;
+    vad->packets++;
+
+    // Down right away, up by 1/64 per packet (3.4 dB/s at 20 ms): it takes seconds of constant sound to become noise
+    if (level < vad->noise)
+        vad->noise = level;
+    else
+        vad->noise = MIN(level, vad->noise + vad->noise / 64 + 1);
+
+    bool voice = energy > MIN_ENERGY && (uint64_t)energy * 256 * 256 > (uint64_t)vad->noise * vad->threshold;
+
+    if (voice)
+    {
+        if (!vad->active)
+            vad->talkspurts++;
+        vad->active = true;
+        vad->hangover = HANGOVER_PACKETS;
+    }
+    else if (vad->hangover > 0)
+    {
+        vad->hangover--;
+    }
+    else
+    {
+        vad->active = false;
+        vad->silent++;
+    }
+
+    return vad->active;
+}
+
+// Level of the last packet for a comfort noise payload, in -dBov
+uint8_t vad_noise_level(vad_t *vad)
+{
+    if (vad->energy == 0)
+        return VAD_NOISE_LEVEL_MAX;
+
+    float level = 10.0f * log10f((float)FULL_SCALE_ENERGY / vad->energy);
+
+    return level > VAD_NOISE_LEVEL_MAX ? VAD_NOISE_LEVEL_MAX : (uint8_t)lrintf(level);
+}
+
+void vad_log_stats(vad_t *vad)
+{
+    if (vad->packets == 0)
+        return;
+
+    ESP_LOGI(TAG, "Talkspurts: %" PRIu32 ", silent packets: %" PRIu32 " (%" PRIu32 " %%), noise floor: -%" PRIu32 " dBov",
+             vad->talkspurts, vad->silent, (vad->silent * 100) / vad->packets,
+             vad->noise == UINT32_MAX ? 0 : (uint32_t)lrintf(10.0f * log10f((float)FULL_SCALE_ENERGY * 256 / (vad->noise + 1))));
+}
+
+void comfort_noise_init(comfort_noise_t *cn)
+{
+    cn->seed = 2463534242;
+    cn->amplitude = 0;
+}
+
+// Start playing noise at a level received in a comfort noise payload
+void comfort_noise_set(comfort_noise_t *cn, uint8_t level)
+{
+    // The RMS of a uniform noise is its amplitude / sqrt(3)
+    float amplitude = sqrtf(3.0f * FULL_SCALE_ENERGY) * powf(10.0f, -(level & VAD_NOISE_LEVEL_MAX) / 20.0f);
+
+    cn->amplitude = amplitude > SILENCE - 1 ? SILENCE - 1 : lrintf(amplitude);
+}
+
+void comfort_noise_fill(comfort_noise_t *cn, uint8_t *samples, size_t length)
+{
+    uint32_t x = cn->seed;
+    uint32_t range = 2 * cn->amplitude + 1;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        samples[i] = SILENCE - cn->amplitude + (x >> 16) % range;
+    }
+
+    cn->seed = x;
+}
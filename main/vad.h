@@ -0,0 +1,54 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Voice activity detection and comfort noise (RFC 3389).
+ *
+ * The detector compares the mean square level of each packet with a noise
+ * floor that follows the quietest packets quickly and the louder ones slowly.
+ * Voice is detected CONFIG_AUDIO_VAD_THRESHOLD_DB above the floor and lasts
+ * CONFIG_AUDIO_VAD_HANGOVER_MS after the last voiced packet, so that word
+ * endings are not cut.
+ *
+ * During silence, the sender only sends comfort noise packets, whose payload
+ * is the noise level in -dBov (0 to 127). The receiver plays white noise at
+ * that level until audio comes back.
+ */
+#define VAD_NOISE_LEVEL_MAX 127
+
+typedef struct vad
+{
+    uint32_t noise;     // Noise floor, mean square level << 8
+    uint32_t threshold; // Voice over noise mean square ratio << 8
+    uint32_t hangover;  // Packets before silence
+    bool active;
+    uint32_t energy;    // Mean square level of the last packet
+
+    uint32_t packets;
+    uint32_t silent;
+    uint32_t talkspurts;
+} vad_t;
+
+typedef struct comfort_noise
+{
+    uint32_t seed;
+    uint16_t amplitude; // Of the uniform noise, 0 when not playing
+} comfort_noise_t;
+
+void vad_init(vad_t *vad);
+bool vad_update(vad_t *vad, const uint8_t *samples, size_t length);
+uint8_t vad_noise_level(vad_t *vad);
+void vad_log_stats(vad_t *vad);
+
+void comfort_noise_init(comfort_noise_t *cn);
+void comfort_noise_set(comfort_noise_t *cn, uint8_t level);
+void comfort_noise_fill(comfort_noise_t *cn, uint8_t *samples, size_t length);
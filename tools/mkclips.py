@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+#
+# SPDX-FileCopyrightText: 2024 Detlev Casanova <dc@detlev.ca>
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Build the image of the clips partition (see main/clip.h) from WAV files
+# and/or the built-in tones, then flash it with:
+#
+#   parttool.py write_partition --partition-name clips --input clips.bin
+
+import argparse
+import math
+import struct
+import sys
+import wave
+
+MAGIC = b"CLIP"
+VERSION = 1
+NAME_LEN = 16
+HEADER = struct.Struct("<4sHHII")
+ENTRY = struct.Struct("<16sII")
+PARTITION_SIZE = 0xF0000
+AMPLITUDE = 100
+
+
+def tone(rate, segments):
+    """segments: (frequency, duration in s, decay in 1/s), frequency 0 for silence"""
+    samples = []
+    for freq, duration, decay in segments:
+        for n in range(int(rate * duration)):
+            t = n / rate
+            v = AMPLITUDE * math.exp(-decay * t) * math.sin(2 * math.pi * freq * t) if freq else 0
+            samples.append(128 + round(v))
+    return bytes(samples)
+
+
+def tones(rate):
+    return {
+        "chime": tone(rate, [(660, 0.6, 4), (550, 0.9, 3)]),
+        "busy": tone(rate, [(425, 0.5, 0), (0, 0.5, 0)] * 3),
+        "door": tone(rate, [(880, 0.15, 0), (0, 0.05, 0), (1320, 0.25, 0)]),
+    }
+
+
+def read_wav(path, rate):
+    with wave.open(path, "rb") as w:
+        width = w.getsampwidth()
+        channels = w.getnchannels()
+        src_rate = w.getframerate()
+        frames = w.readframes(w.getnframes())
+
+    if width not in (1, 2):
+        sys.exit(f"{path}: only 8 and 16 bit PCM are supported")
+
+    # Mono, centered on 0, in 8 bit steps
+    values = []
+    step = width * channels
+    for i in range(0, len(frames) - step + 1, step):
+        total = 0
+        for c in range(channels):
+            if width == 1:
+                total += frames[i + c] - 128
+            else:
+                total += struct.unpack_from("<h", frames, i + 2 * c)[0] / 256
+        values.append(total / channels)
+
+    # Linear interpolation to the stream rate
+    out = []
+    count = int(len(values) * rate / src_rate)
+    for n in range(count):
+        pos = n * src_rate / rate
+        i = int(pos)
+        frac = pos - i
+        a = values[i]
+        b = values[min(i + 1, len(values) - 1)]
+        out.append(min(255, max(0, 128 + round(a + (b - a) * frac))))
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build the image of the clips partition")
+    parser.add_argument("clips", nargs="*", metavar="NAME=FILE.wav")
+    parser.add_argument("-r", "--rate", type=int, default=44100, help="CONFIG_AUDIO_SAMPLE_RATE")
+    parser.add_argument("-o", "--output", default="clips.bin")
+    parser.add_argument("--tones", action="store_true", help="add the chime, busy and door tones")
+    args = parser.parse_args()
+
+    clips = tones(args.rate) if args.tones else {}
+    for spec in args.clips:
+        name, _, path = spec.partition("=")
+        if not path:
+            sys.exit(f"{spec}: expected NAME=FILE.wav")
+        clips[name] = read_wav(path, args.rate)
+
+    for name in clips:
+        if len(name.encode()) > NAME_LEN:
+            sys.exit(f"{name}: names are at most {NAME_LEN} bytes")
+
+    index = HEADER.size + len(clips) * ENTRY.size
+    offset = index
+    header = HEADER.pack(MAGIC, VERSION, len(clips), args.rate, 0)
+    entries = b""
+    data = b""
+    for name, samples in clips.items():
+        entries += ENTRY.pack(name.encode(), offset, len(samples))
+        data += samples
+        offset += len(samples)
+
+    image = header + entries + data
+    if len(image) > PARTITION_SIZE:
+        sys.exit(f"{len(image)} bytes do not fit in the {PARTITION_SIZE} bytes partition")
+
+    with open(args.output, "wb") as f:
+        f.write(image)
+
+    for name, samples in clips.items():
+        print(f"{name:16} {len(samples) * 1000 // args.rate:6} ms")
+
+
+if __name__ == "__main__":
+    main()